@@ -1,6 +1,24 @@
 #include <GLEW/glew.h>
 #include <GLFW/glfw3.h>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <queue>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <xmmintrin.h>
 
 //GLM library
 #include <glm/glm/glm.hpp>
@@ -12,18 +30,21 @@
 using namespace std;
 
 int width, height;
+int renderWidth, renderHeight; // Scene resolution after dynamic scaling
 const double PI = 3.14159;
 const float toRadians = PI / 180.0f;
 
 // Declare Input Callback Function prototypes
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
+void window_refresh_callback(GLFWwindow* window);
 void cursor_position_callback(GLFWwindow* window, double xpos, double ypos);
 void mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
 void UProcessInput(GLFWwindow* window);
 
-// Declare View Matrix
+// Declare View and Projection Matrices (kept for picking)
 glm::mat4 viewMatrix;
+glm::mat4 projectionMatrix;
 
 // Camera Field of View
 GLfloat fov = 45.0f;
@@ -59,6 +80,512 @@ bool firstMouseMove = true;
 //Light source Position
 glm::vec3 lightPosition(0.0f, 1.0f, 2.0f);
 
+// Light and object colors (the baker uses the same ambient strength as the fragment shader)
+const glm::vec3 objectColor(0.392f, 0.4901f, 0.0f);
+const glm::vec3 lightColor(0.15f, 1.0f, 0.0f);
+const float ambientStrength = 0.8f;
+
+// Texture streaming settings
+size_t textureBudgetBytes = 64 * 1024 * 1024; // VRAM the streamed textures may occupy
+const int initialTextureSize = 256; // Largest mip uploaded when a texture is first loaded
+const int textureShrinkDelayFrames = 120; // Frames a texture must need fewer mips before they are dropped
+const unsigned textureStreamingThreads = 2;
+size_t textureSourceCacheBytes = 64 * 1024 * 1024; // Decoded images kept in RAM so streaming rarely re-reads files
+
+// Print GPU memory usage (F1)
+bool memoryReportRequested = false;
+void reportGpuMemory();
+
+// Print last frame's issued and filtered GL state calls (F10, debug builds)
+bool stateReportRequested = false;
+
+// On-demand rendering: frames are only drawn when something invalidated them
+const double idleWaitSeconds = 0.5; // Longest sleep in glfwWaitEventsTimeout with nothing to draw
+const int partialRedrawMargin = 2; // Render pixels around a partial redraw, for filtering and sharpening
+
+// Dynamic resolution settings
+bool dynamicResolution = true; // F2 toggles
+bool sharpenUpscale = true; // F3 toggles between sharpening and plain bilinear upscale
+const float targetGpuFrameMs = 15.0f; // GPU budget per frame, leaving headroom under 60 Hz
+const float minRenderScale = 0.5f, maxRenderScale = 1.0f;
+float renderScale = 1.0f;
+
+// Projection clip planes
+const float projectionNear = 0.1f, projectionFar = 100.0f;
+
+// Frame capture settings
+enum class CaptureFormat { PNG, QOI, Y4M };
+CaptureFormat captureFormat = CaptureFormat::QOI; // F6 cycles
+bool captureToggleRequested = false; // F5 starts and stops recording
+const int capturePboCount = 3; // Readbacks in flight before the oldest must be mapped
+const int maxCaptureBuffers = 8; // Frames waiting for the encoders before capture waits on them
+const int captureVideoFps = 60;
+
+// Poster settings (F7 renders poster.tif)
+int posterWidth = 16384, posterHeight = 16384;
+const int posterTileSize = 1024; // Tiled TIFF needs a multiple of 16
+bool posterRequested = false;
+
+// Picking (left click without Alt)
+bool pickRequested = false;
+double pickX = 0.0, pickY = 0.0; // Cursor position at the click
+const int bvhMaxLeafSize = 4;
+const int bvhSahBins = 12;
+const size_t bvhBatchChunk = 1024; // Rays per worker job in batched queries
+const glm::vec3 selectionColor(1.0f, 0.8f, 0.2f); // Tint of the picked object
+
+// Lightmap baking (F8 bakes, F9 toggles between baked and per pixel lighting). A finished bake is
+// saved and loaded by later runs while it matches the scene; without one lighting is per pixel.
+bool bakeRequested = false;
+bool useBakedLighting = true;
+const char* const bakeFilePath = "lighting.bake";
+const int lightmapAtlasWidth = 512;
+const float lightmapTexelsPerUnit = 12.0f;
+const int lightmapPadding = 2; // Texels around each chart, filled from its edge
+const int bakeTileSize = 32; // Texels per side of one worker job
+const int bakeSamplesPerPass = 8; // Samples per texel between lightmap refreshes
+int bakeSampleBudget = 256;
+const int bakeMaxBounces = 2;
+const int probeGridX = 8, probeGridY = 4, probeGridZ = 8;
+const int probeSamples = 1024;
+
+// GPU memory totals kept up to date by GLHandle
+struct GpuMemoryStats {
+	size_t bufferBytes = 0, textureBytes = 0; // textureBytes includes renderbuffers
+	int buffers = 0, vertexArrays = 0, textures = 0, framebuffers = 0, renderbuffers = 0, queries = 0, programs = 0, fences = 0;
+};
+GpuMemoryStats gpuMemory;
+
+// Kinds of GL objects owned by GLHandle
+enum class GLObjectType { Buffer, VertexArray, Texture, Framebuffer, Renderbuffer, Query, Program };
+
+// State changing calls counted by GLStateCache
+enum class GLStateCall { Program, VertexArray, Buffer, ActiveTexture, Texture, Framebuffer, Capability, DepthState, BlendFunc, Count };
+
+// Shadow copy of the bound GL state. Calls that would not change anything are dropped, and
+// unbinding a program or VAO is deferred so the usual "unbind, bind the next one" pairs cost
+// one call. Everything that binds goes through the global glState so the copy stays true.
+class GLStateCache
+{
+public:
+	// A new context starts on texture unit 0; leaving it unknown would keep texture binds
+	// from being filtered until the first activeTexture call
+	GLStateCache()
+	{
+		invalidate();
+		activeUnit = GL_TEXTURE0;
+	}
+
+	// Forget everything, e.g. after code that changed state behind the cache's back
+	void invalidate()
+	{
+		program = vertexArray = unknown;
+		programUnbindPending = vertexArrayUnbindPending = false;
+		activeUnit = unknown;
+		for (GLuint& buffer : buffers)
+			buffer = unknown;
+		for (auto& unit : textures)
+			unit[0] = unit[1] = unknown;
+		drawFramebuffer = readFramebuffer = unknown;
+		for (int& capability : capabilities)
+			capability = -1;
+		depthFunction = blendSource = blendDestination = unknown;
+		depthWrites = -1;
+	}
+
+	void useProgram(GLuint id)
+	{
+		if (id == 0) {
+			programUnbindPending = program != 0;
+			count(GLStateCall::Program, false);
+			return;
+		}
+		programUnbindPending = false;
+		if (id == program) {
+			count(GLStateCall::Program, false);
+			return;
+		}
+		glUseProgram(id);
+		program = id;
+		count(GLStateCall::Program, true);
+	}
+
+	void bindVertexArray(GLuint id)
+	{
+		if (id == 0) {
+			vertexArrayUnbindPending = vertexArray != 0;
+			count(GLStateCall::VertexArray, false);
+			return;
+		}
+		vertexArrayUnbindPending = false;
+		if (id == vertexArray) {
+			count(GLStateCall::VertexArray, false);
+			return;
+		}
+		glBindVertexArray(id);
+		vertexArray = id;
+		buffers[elementSlot] = unknown; // The element buffer binding belongs to the VAO
+		count(GLStateCall::VertexArray, true);
+	}
+
+	// Carry out deferred unbinds, for code that needs nothing bound
+	void flushUnbinds()
+	{
+		if (programUnbindPending) {
+			glUseProgram(0);
+			program = 0;
+			programUnbindPending = false;
+			count(GLStateCall::Program, true);
+		}
+		if (vertexArrayUnbindPending) {
+			glBindVertexArray(0);
+			vertexArray = 0;
+			buffers[elementSlot] = unknown;
+			vertexArrayUnbindPending = false;
+			count(GLStateCall::VertexArray, true);
+		}
+	}
+
+	void bindBuffer(GLenum target, GLuint id)
+	{
+		int slot = bufferSlot(target);
+		if (slot == elementSlot)
+			flushUnbinds(); // Must not land in the VAO that is only unbound on paper
+		if (slot >= 0 && buffers[slot] == id) {
+			count(GLStateCall::Buffer, false);
+			return;
+		}
+		glBindBuffer(target, id);
+		if (slot >= 0)
+			buffers[slot] = id;
+		count(GLStateCall::Buffer, true);
+	}
+
+	void activeTexture(GLenum unit)
+	{
+		if (unit == activeUnit) {
+			count(GLStateCall::ActiveTexture, false);
+			return;
+		}
+		glActiveTexture(unit);
+		activeUnit = unit;
+		count(GLStateCall::ActiveTexture, true);
+	}
+
+	// Bind to the active texture unit
+	void bindTexture(GLenum target, GLuint id)
+	{
+		int slot = target == GL_TEXTURE_2D ? 0 : target == GL_TEXTURE_3D ? 1 : -1;
+		GLuint* bound = nullptr;
+		if (slot >= 0 && activeUnit != unknown && activeUnit - GL_TEXTURE0 < trackedTextureUnits)
+			bound = &textures[activeUnit - GL_TEXTURE0][slot];
+		if (bound && *bound == id) {
+			count(GLStateCall::Texture, false);
+			return;
+		}
+		glBindTexture(target, id);
+		if (bound)
+			*bound = id;
+		count(GLStateCall::Texture, true);
+	}
+
+	void bindFramebuffer(GLenum target, GLuint id)
+	{
+		bool draw = target != GL_READ_FRAMEBUFFER, read = target != GL_DRAW_FRAMEBUFFER;
+		if ((!draw || drawFramebuffer == id) && (!read || readFramebuffer == id)) {
+			count(GLStateCall::Framebuffer, false);
+			return;
+		}
+		glBindFramebuffer(target, id);
+		if (draw)
+			drawFramebuffer = id;
+		if (read)
+			readFramebuffer = id;
+		count(GLStateCall::Framebuffer, true);
+	}
+
+	void enable(GLenum capability) { setCapability(capability, true); }
+	void disable(GLenum capability) { setCapability(capability, false); }
+
+	void depthFunc(GLenum function)
+	{
+		if (function == depthFunction) {
+			count(GLStateCall::DepthState, false);
+			return;
+		}
+		glDepthFunc(function);
+		depthFunction = function;
+		count(GLStateCall::DepthState, true);
+	}
+
+	void depthMask(GLboolean writes)
+	{
+		if (depthWrites == (int)(writes != GL_FALSE)) {
+			count(GLStateCall::DepthState, false);
+			return;
+		}
+		glDepthMask(writes);
+		depthWrites = writes != GL_FALSE;
+		count(GLStateCall::DepthState, true);
+	}
+
+	void blendFunc(GLenum source, GLenum destination)
+	{
+		if (source == blendSource && destination == blendDestination) {
+			count(GLStateCall::BlendFunc, false);
+			return;
+		}
+		glBlendFunc(source, destination);
+		blendSource = source;
+		blendDestination = destination;
+		count(GLStateCall::BlendFunc, true);
+	}
+
+	// GL falls back to 0 for bindings of a deleted object
+	void objectDeleted(GLObjectType type, GLuint id)
+	{
+		switch (type) {
+		case GLObjectType::Buffer:
+			for (GLuint& buffer : buffers)
+				if (buffer == id)
+					buffer = 0;
+			break;
+		case GLObjectType::VertexArray:
+			if (vertexArray == id) {
+				vertexArray = 0;
+				buffers[elementSlot] = unknown;
+			}
+			break;
+		case GLObjectType::Texture:
+			for (auto& unit : textures)
+				for (GLuint& texture : unit)
+					if (texture == id)
+						texture = 0;
+			break;
+		case GLObjectType::Framebuffer:
+			if (drawFramebuffer == id)
+				drawFramebuffer = 0;
+			if (readFramebuffer == id)
+				readFramebuffer = 0;
+			break;
+		case GLObjectType::Program:
+			// A deleted program stays current until something else is used, so only forget it
+			if (program == id)
+				program = unknown;
+			break;
+		default:
+			break;
+		}
+	}
+
+	// Close this frame's statistics (debug builds only)
+	void endFrame()
+	{
+#ifdef _DEBUG
+		for (int i = 0; i < (int)GLStateCall::Count; i++) {
+			lastIssued[i] = frameIssued[i];
+			lastFiltered[i] = frameFiltered[i];
+			frameIssued[i] = frameFiltered[i] = 0;
+		}
+#endif
+	}
+
+	void report() const
+	{
+#ifdef _DEBUG
+		const char* names[] = { "program", "vertex array", "buffer", "active texture", "texture", "framebuffer", "enable/disable", "depth state", "blend func" };
+		cout << "GL state calls last frame (issued / filtered):" << endl;
+		int totalIssued = 0, totalFiltered = 0;
+		for (int i = 0; i < (int)GLStateCall::Count; i++) {
+			cout << "  " << names[i] << ": " << lastIssued[i] << " / " << lastFiltered[i] << endl;
+			totalIssued += lastIssued[i];
+			totalFiltered += lastFiltered[i];
+		}
+		cout << "  total: " << totalIssued << " / " << totalFiltered << endl;
+#else
+		cout << "GL state call statistics are only recorded in debug builds" << endl;
+#endif
+	}
+
+private:
+	static const GLuint unknown = 0xFFFFFFFFu; // Never a valid name, so the next call always goes through
+	static const int elementSlot = 1;
+	static const int trackedTextureUnits = 8;
+
+	static int bufferSlot(GLenum target)
+	{
+		switch (target) {
+		case GL_ARRAY_BUFFER: return 0;
+		case GL_ELEMENT_ARRAY_BUFFER: return elementSlot;
+		case GL_PIXEL_PACK_BUFFER: return 2;
+		case GL_PIXEL_UNPACK_BUFFER: return 3;
+		default: return -1;
+		}
+	}
+
+	static int capabilitySlot(GLenum capability)
+	{
+		switch (capability) {
+		case GL_DEPTH_TEST: return 0;
+		case GL_BLEND: return 1;
+		case GL_SCISSOR_TEST: return 2;
+		case GL_CULL_FACE: return 3;
+		default: return -1;
+		}
+	}
+
+	void setCapability(GLenum capability, bool on)
+	{
+		int slot = capabilitySlot(capability);
+		if (slot >= 0 && capabilities[slot] == (int)on) {
+			count(GLStateCall::Capability, false);
+			return;
+		}
+		if (on)
+			glEnable(capability);
+		else
+			glDisable(capability);
+		if (slot >= 0)
+			capabilities[slot] = on;
+		count(GLStateCall::Capability, true);
+	}
+
+#ifdef _DEBUG
+	void count(GLStateCall call, bool issued) { (issued ? frameIssued : frameFiltered)[(int)call]++; }
+	int frameIssued[(int)GLStateCall::Count] = {}, frameFiltered[(int)GLStateCall::Count] = {};
+	int lastIssued[(int)GLStateCall::Count] = {}, lastFiltered[(int)GLStateCall::Count] = {};
+#else
+	void count(GLStateCall, bool) {}
+#endif
+
+	GLuint program, vertexArray;
+	bool programUnbindPending, vertexArrayUnbindPending;
+	GLenum activeUnit;
+	GLuint buffers[4];
+	GLuint textures[trackedTextureUnits][2]; // 2D and 3D per unit
+	GLuint drawFramebuffer, readFramebuffer;
+	int capabilities[4]; // -1 unknown, else 0 or 1
+	GLenum depthFunction, blendSource, blendDestination;
+	int depthWrites;
+};
+GLStateCache glState;
+
+// Owns one GL object name, frees it on release and keeps gpuMemory up to date
+class GLHandle
+{
+public:
+	GLHandle() {}
+	explicit GLHandle(GLObjectType objectType) : type(objectType)
+	{
+		switch (type) {
+		case GLObjectType::Buffer: glGenBuffers(1, &id); gpuMemory.buffers++; break;
+		case GLObjectType::VertexArray: glGenVertexArrays(1, &id); gpuMemory.vertexArrays++; break;
+		case GLObjectType::Texture: glGenTextures(1, &id); gpuMemory.textures++; break;
+		case GLObjectType::Framebuffer: glGenFramebuffers(1, &id); gpuMemory.framebuffers++; break;
+		case GLObjectType::Renderbuffer: glGenRenderbuffers(1, &id); gpuMemory.renderbuffers++; break;
+		case GLObjectType::Query: glGenQueries(1, &id); gpuMemory.queries++; break;
+		case GLObjectType::Program: id = glCreateProgram(); gpuMemory.programs++; break;
+		}
+	}
+	GLHandle(GLHandle&& other) { *this = move(other); }
+	GLHandle& operator=(GLHandle&& other)
+	{
+		if (this != &other) {
+			release();
+			type = other.type; id = other.id; bytes = other.bytes;
+			other.id = 0; other.bytes = 0;
+		}
+		return *this;
+	}
+	GLHandle(const GLHandle&) = delete;
+	GLHandle& operator=(const GLHandle&) = delete;
+	~GLHandle() { release(); }
+
+	operator GLuint() const { return id; }
+
+	// Select buffer and load its data, replacing whatever it held before
+	void bufferData(GLenum target, GLsizeiptr size, const void* data, GLenum usage)
+	{
+		glState.bindBuffer(target, id);
+		glBufferData(target, size, data, usage);
+		trackBytes(size);
+	}
+
+	// Record the size of the storage now backing this object
+	void trackBytes(size_t newBytes)
+	{
+		if (type == GLObjectType::Texture || type == GLObjectType::Renderbuffer)
+			gpuMemory.textureBytes += newBytes - bytes;
+		else
+			gpuMemory.bufferBytes += newBytes - bytes;
+		bytes = newBytes;
+	}
+
+	void release()
+	{
+		if (id == 0)
+			return;
+
+		trackBytes(0);
+		bool hasContext = glfwGetCurrentContext() != nullptr; // Names die with the context after glfwTerminate
+		if (hasContext)
+			glState.objectDeleted(type, id);
+		switch (type) {
+		case GLObjectType::Buffer: if (hasContext) glDeleteBuffers(1, &id); gpuMemory.buffers--; break;
+		case GLObjectType::VertexArray: if (hasContext) glDeleteVertexArrays(1, &id); gpuMemory.vertexArrays--; break;
+		case GLObjectType::Texture: if (hasContext) glDeleteTextures(1, &id); gpuMemory.textures--; break;
+		case GLObjectType::Framebuffer: if (hasContext) glDeleteFramebuffers(1, &id); gpuMemory.framebuffers--; break;
+		case GLObjectType::Renderbuffer: if (hasContext) glDeleteRenderbuffers(1, &id); gpuMemory.renderbuffers--; break;
+		case GLObjectType::Query: if (hasContext) glDeleteQueries(1, &id); gpuMemory.queries--; break;
+		case GLObjectType::Program: if (hasContext) glDeleteProgram(id); gpuMemory.programs--; break;
+		}
+		id = 0;
+	}
+
+	GLObjectType type = GLObjectType::Buffer;
+	GLuint id = 0;
+	size_t bytes = 0;
+};
+
+// Owns one fence sync object (fences are pointers rather than names, so GLHandle cannot hold them)
+class GLFence
+{
+public:
+	GLFence() {}
+	GLFence(const GLFence&) = delete;
+	GLFence& operator=(const GLFence&) = delete;
+	~GLFence() { release(); }
+
+	explicit operator bool() const { return sync != nullptr; }
+
+	// Fence everything submitted so far, replacing an older fence
+	void insert()
+	{
+		release();
+		sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		gpuMemory.fences++;
+	}
+
+	// Wait up to timeout nanoseconds; false if the GPU has not reached the fence yet
+	bool wait(GLbitfield flags, GLuint64 timeout)
+	{
+		return glClientWaitSync(sync, flags, timeout) != GL_TIMEOUT_EXPIRED;
+	}
+
+	void release()
+	{
+		if (!sync)
+			return;
+		if (glfwGetCurrentContext())
+			glDeleteSync(sync);
+		sync = nullptr;
+		gpuMemory.fences--;
+	}
+
+	GLsync sync = nullptr;
+};
+
+
 // Draw Primitive(s)
 void draw()
 {
@@ -66,56 +593,2536 @@ void draw()
 	GLsizei indices = 36;
 	glDrawElements(mode, indices, GL_UNSIGNED_BYTE, nullptr); 
 
-	GLsizei floorIndices = 6;
-	glDrawElements(mode, floorIndices, GL_UNSIGNED_BYTE, nullptr);
-}
+	GLsizei floorIndices = 6;
+	glDrawElements(mode, floorIndices, GL_UNSIGNED_BYTE, nullptr);
+}
+
+
+// Create and Compile Shaders
+static GLuint CompileShader(const string& source, GLuint shaderType)
+{
+	// Create Shader object
+	GLuint shaderID = glCreateShader(shaderType);
+	const char* src = source.c_str();
+
+	// Attach source code to Shader object
+	glShaderSource(shaderID, 1, &src, nullptr);
+
+	// Compile Shader
+	glCompileShader(shaderID);
+
+	// Return ID of Compiled shader
+	return shaderID;
+
+}
+
+// Create Program Object
+static GLHandle CreateShaderProgram(const string& vertexShader, const string& fragmentShader)
+{
+	// Compile vertex shader
+	GLuint vertexShaderComp = CompileShader(vertexShader, GL_VERTEX_SHADER);
+
+	// Compile fragment shader
+	GLuint fragmentShaderComp = CompileShader(fragmentShader, GL_FRAGMENT_SHADER);
+
+	// Create program object
+	GLHandle shaderProgram(GLObjectType::Program);
+
+	// Attach vertex and fragment shaders to program object
+	glAttachShader(shaderProgram, vertexShaderComp);
+	glAttachShader(shaderProgram, fragmentShaderComp);
+
+	// Link shaders to create executable
+	glLinkProgram(shaderProgram);
+
+	// Delete compiled vertex and fragment shaders
+	glDeleteShader(vertexShaderComp);
+	glDeleteShader(fragmentShaderComp);
+
+	// Return Shader Program
+	return shaderProgram;
+
+}
+
+
+// Feature bits of the scene shader; each combination compiles to its own specialized variant
+enum ShaderFeature : unsigned {
+	ShaderTextured = 1 << 0,
+	ShaderLit = 1 << 1, // Ambient and diffuse light from the point light
+	ShaderSpecular = 1 << 2,
+	ShaderVertexColor = 1 << 3,
+	ShaderInstanced = 1 << 4, // Model matrix from attribute 5 instead of a uniform
+	ShaderLightmapped = 1 << 5, // Baked lighting replaces the lit terms
+	ShaderProbes = 1 << 6 // Bounce light from the probe grid on top of the lit terms
+};
+const int shaderFeatureCount = 7;
+
+// Smallest variant for a mesh whose VAO enables the attribute locations set in vertexAttributes
+// (bit n for location n), drawn with a material using materialFeatures
+static unsigned shaderVariant(unsigned vertexAttributes, unsigned materialFeatures)
+{
+	unsigned features = materialFeatures;
+	if (!(vertexAttributes & (1 << 1)))
+		features &= ~ShaderVertexColor;
+	if (!(vertexAttributes & (1 << 2)))
+		features &= ~ShaderTextured;
+	if (!(vertexAttributes & (1 << 3)))
+		features &= ~ShaderLit;
+	if (!(vertexAttributes & (1 << 4)))
+		features &= ~ShaderLightmapped;
+	if (!(vertexAttributes & (1 << 5)))
+		features &= ~ShaderInstanced;
+	if (features & ShaderLightmapped)
+		features &= ~ShaderLit;
+	if (!(features & ShaderLit))
+		features &= ~(ShaderSpecular | ShaderProbes);
+	return features;
+}
+
+// Compiles scene shader variants on first use and keeps them keyed by their feature bits
+class ShaderCache
+{
+public:
+	ShaderCache(const string& vertexShader, const string& fragmentShader)
+		: vertexSource(vertexShader), fragmentSource(fragmentShader), programs(1 << shaderFeatureCount) {}
+
+	GLuint program(unsigned features)
+	{
+		GLHandle& cached = programs[features];
+		if (cached != 0)
+			return cached;
+
+		string defines;
+		const char* names[shaderFeatureCount] = { "TEXTURED", "LIT", "SPECULAR", "VERTEX_COLOR", "INSTANCED", "LIGHTMAPPED", "PROBES" };
+		for (int bit = 0; bit < shaderFeatureCount; bit++)
+			if (features & (1u << bit))
+				defines += string("#define ") + names[bit] + "\n";
+		cached = CreateShaderProgram(withDefines(vertexSource, defines), withDefines(fragmentSource, defines));
+
+		// Fixed texture units: the object's texture, the lightmap and the three probe channels
+		glState.useProgram(cached);
+		glUniform1i(glGetUniformLocation(cached, "myTexture"), 0);
+		glUniform1i(glGetUniformLocation(cached, "lightmap"), 1);
+		glUniform1i(glGetUniformLocation(cached, "probeRed"), 2);
+		glUniform1i(glGetUniformLocation(cached, "probeGreen"), 3);
+		glUniform1i(glGetUniformLocation(cached, "probeBlue"), 4);
+		glState.useProgram(0);
+		return cached;
+	}
+
+	void release()
+	{
+		for (GLHandle& cached : programs)
+			cached.release();
+	}
+
+private:
+	// Defines go right after the #version line
+	static string withDefines(const string& source, const string& defines)
+	{
+		size_t versionEnd = source.find('\n') + 1;
+		return source.substr(0, versionEnd) + defines + source.substr(versionEnd);
+	}
+
+	string vertexSource, fragmentSource;
+	vector<GLHandle> programs; // Indexed by feature bits, 0 until compiled
+};
+
+
+// Fixed set of worker threads running queued jobs in order
+class WorkerPool
+{
+public:
+	explicit WorkerPool(unsigned threadCount)
+	{
+		for (unsigned i = 0; i < threadCount; i++)
+			workers.emplace_back([this] { run(); });
+	}
+	~WorkerPool() { stop(); }
+
+	void submit(function<void()> job)
+	{
+		{
+			lock_guard<mutex> lock(jobMutex);
+			jobs.push_back(move(job));
+		}
+		jobReady.notify_one();
+	}
+
+	// Block until every queued job has finished
+	void wait()
+	{
+		unique_lock<mutex> lock(jobMutex);
+		allDone.wait(lock, [this] { return jobs.empty() && busy == 0; });
+	}
+
+	// Finish queued jobs and join the threads
+	void stop()
+	{
+		{
+			lock_guard<mutex> lock(jobMutex);
+			stopping = true;
+		}
+		jobReady.notify_all();
+		for (thread& worker : workers)
+			if (worker.joinable())
+				worker.join();
+		workers.clear();
+	}
+
+private:
+	void run()
+	{
+		for (;;) {
+			function<void()> job;
+			{
+				unique_lock<mutex> lock(jobMutex);
+				jobReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (jobs.empty())
+					return;
+				job = move(jobs.front());
+				jobs.pop_front();
+				busy++;
+			}
+			job();
+			{
+				lock_guard<mutex> lock(jobMutex);
+				busy--;
+			}
+			allDone.notify_all();
+		}
+	}
+
+	vector<thread> workers;
+	deque<function<void()>> jobs;
+	mutex jobMutex;
+	condition_variable jobReady, allDone;
+	int busy = 0;
+	bool stopping = false;
+};
+
+
+// Halve an image with a 2x2 box filter (odd edges reuse the last row/column)
+static vector<unsigned char> downsampleImage(const vector<unsigned char>& src, int srcWidth, int srcHeight, int channels, int& dstWidth, int& dstHeight)
+{
+	dstWidth = max(1, srcWidth / 2);
+	dstHeight = max(1, srcHeight / 2);
+	vector<unsigned char> dst((size_t)dstWidth * dstHeight * channels);
+
+	for (int y = 0; y < dstHeight; y++) {
+		int y0 = min(y * 2, srcHeight - 1), y1 = min(y * 2 + 1, srcHeight - 1);
+		for (int x = 0; x < dstWidth; x++) {
+			int x0 = min(x * 2, srcWidth - 1), x1 = min(x * 2 + 1, srcWidth - 1);
+			for (int c = 0; c < channels; c++) {
+				int sum = src[((size_t)y0 * srcWidth + x0) * channels + c] + src[((size_t)y0 * srcWidth + x1) * channels + c]
+					+ src[((size_t)y1 * srcWidth + x0) * channels + c] + src[((size_t)y1 * srcWidth + x1) * channels + c];
+				dst[((size_t)y * dstWidth + x) * channels + c] = (unsigned char)((sum + 2) / 4);
+			}
+		}
+	}
+	return dst;
+}
+
+// Number of levels in a full mip chain
+static int mipLevelCount(int texWidth, int texHeight)
+{
+	int levels = 1;
+	while (texWidth > 1 || texHeight > 1) {
+		texWidth = max(1, texWidth / 2);
+		texHeight = max(1, texHeight / 2);
+		levels++;
+	}
+	return levels;
+}
+
+// Bytes needed on the GPU for levels [firstLevel, mipCount) (drivers pad RGB texels to 4 bytes)
+static size_t mipChainBytes(int texWidth, int texHeight, int firstLevel, int mipCount)
+{
+	size_t total = 0;
+	for (int level = 0; level < mipCount; level++) {
+		if (level >= firstLevel)
+			total += (size_t)texWidth * texHeight * 4;
+		texWidth = max(1, texWidth / 2);
+		texHeight = max(1, texHeight / 2);
+	}
+	return total;
+}
+
+// Clip a clip-space polygon against one frustum plane (Sutherland-Hodgman), carrying texture
+// coordinates along; attributes interpolate linearly before the perspective divide
+static int clipPolygonToPlane(const glm::vec4* in, const glm::vec2* inUv, int count, int plane, glm::vec4* out, glm::vec2* outUv)
+{
+	auto distance = [plane](const glm::vec4& clip) {
+		float coordinate = plane < 2 ? clip.x : (plane < 4 ? clip.y : clip.z);
+		return plane % 2 == 0 ? clip.w + coordinate : clip.w - coordinate;
+	};
+
+	int outCount = 0;
+	for (int i = 0; i < count; i++) {
+		int next = (i + 1) % count;
+		float d0 = distance(in[i]), d1 = distance(in[next]);
+		if (d0 >= 0.0f) {
+			out[outCount] = in[i];
+			outUv[outCount++] = inUv[i];
+		}
+		if ((d0 >= 0.0f) != (d1 >= 0.0f)) {
+			float t = d0 / (d0 - d1);
+			out[outCount] = in[i] + (in[next] - in[i]) * t;
+			outUv[outCount++] = inUv[i] + (inUv[next] - inUv[i]) * t;
+		}
+	}
+	return outCount;
+}
+
+// Estimate the finest mip level a textured mesh needs from its on-screen texel density
+// (vertices use the 11 float layout: position, color, texCoord, normal)
+template <typename Index>
+float estimateMipLevel(const GLfloat* meshVertices, const Index* triangles, int indexCount, const glm::mat4& mvp, int texWidth, int texHeight)
+{
+	const int stride = 11;
+	float finest = 1000.0f; // Nothing on screen
+
+	for (int i = 0; i + 2 < indexCount; i += 3) {
+		// Each of the six planes adds at most one vertex, so 3 + 6 is enough
+		glm::vec4 polygon[2][9];
+		glm::vec2 uvs[2][9];
+		for (int k = 0; k < 3; k++) {
+			const GLfloat* v = meshVertices + (int)triangles[i + k] * stride;
+			polygon[0][k] = mvp * glm::vec4(v[0], v[1], v[2], 1.0f);
+			uvs[0][k] = glm::vec2(v[6] * texWidth, v[7] * texHeight);
+		}
+
+		// Only the part inside the frustum counts, so a plane reaching behind the eye is
+		// measured where it is actually seen
+		int count = 3, current = 0;
+		for (int plane = 0; plane < 6 && count > 0; plane++) {
+			count = clipPolygonToPlane(polygon[current], uvs[current], count, plane, polygon[1 - current], uvs[1 - current]);
+			current = 1 - current;
+		}
+		if (count < 3)
+			continue;
+
+		glm::vec2 screen[9];
+		for (int k = 0; k < count; k++) {
+			const glm::vec4& clip = polygon[current][k];
+			screen[k] = glm::vec2((clip.x / clip.w * 0.5f + 0.5f) * renderWidth, (clip.y / clip.w * 0.5f + 0.5f) * renderHeight);
+		}
+
+		// Texel density of each triangle in the clipped polygon's fan
+		const glm::vec2* uv = uvs[current];
+		for (int k = 1; k + 1 < count; k++) {
+			glm::vec2 s1 = screen[k] - screen[0], s2 = screen[k + 1] - screen[0];
+			glm::vec2 t1 = uv[k] - uv[0], t2 = uv[k + 1] - uv[0];
+			float pixelArea = fabs(s1.x * s2.y - s1.y * s2.x);
+			float texelArea = fabs(t1.x * t2.y - t1.y * t2.x);
+			if (pixelArea < 1.0f || texelArea <= 0.0f)
+				continue;
+
+			// Each mip level quarters the texels covering a pixel
+			finest = min(finest, 0.5f * log2(texelArea / pixelArea));
+		}
+	}
+	return finest;
+}
+
+
+// Texture whose resident mip chain follows what the scene needs
+struct StreamedTexture {
+	string path;
+	int fullWidth = 0, fullHeight = 0, mipCount = 1;
+	GLHandle texture; // Holds levels [residentLevel, mipCount) as its levels 0..n
+	int residentLevel = 0;
+	int targetLevel = 0;
+	int frameRequest = 0; // Finest level requested this frame
+	int shrinkFrames = 0;
+	bool loading = false;
+	unsigned long long lastUsedFrame = 0;
+};
+
+// Decoded mip levels waiting to be uploaded on the GL thread
+struct TextureStreamResult {
+	int textureIndex;
+	int firstLevel;
+	vector<vector<unsigned char>> levels;
+	vector<int> widths, heights; // Full image size first, then one entry per level
+};
+
+// Streams texture mips in and out under a VRAM budget; GL calls stay on the main thread
+class TextureStreamer
+{
+public:
+	TextureStreamer() : workers(textureStreamingThreads) {}
+
+	// Load a texture with only its coarse levels resident and return its index
+	int load(const string& path)
+	{
+		textures.emplace_back();
+		int index = (int)textures.size() - 1;
+		textures[index].path = path;
+
+		int imageWidth = 0, imageHeight = 0;
+		shared_ptr<const vector<unsigned char>> source = decodeSource(path, imageWidth, imageHeight);
+		TextureStreamResult result = buildLevels(source.get(), imageWidth, imageHeight, index, -1);
+		upload(result);
+		return index;
+	}
+
+	GLuint textureId(int index) const { return textures[index].texture; }
+
+	// Ask for the finest level a draw needs this frame
+	void requestMipLevel(int index, float level)
+	{
+		StreamedTexture& tex = textures[index];
+		int wanted = glm::clamp((int)floor(level), 0, tex.mipCount - 1);
+		tex.frameRequest = min(tex.frameRequest, wanted);
+		tex.lastUsedFrame = frame;
+	}
+
+	// Request the level a mesh needs at its current on-screen size
+	template <typename Index>
+	void requestForMesh(int index, const GLfloat* meshVertices, const Index* triangles, int indexCount, const glm::mat4& mvp)
+	{
+		const StreamedTexture& tex = textures[index];
+		requestMipLevel(index, estimateMipLevel(meshVertices, triangles, indexCount, mvp, tex.fullWidth, tex.fullHeight));
+	}
+
+	// Upload what the workers finished; true if any texture changed
+	bool uploadFinished()
+	{
+		vector<TextureStreamResult> finished;
+		{
+			lock_guard<mutex> lock(resultMutex);
+			finished.swap(results);
+		}
+		for (TextureStreamResult& result : finished)
+			upload(result);
+		return !finished.empty();
+	}
+
+	// Upload finished levels, apply the budget and queue new stream jobs; true if any texture
+	// changed. Call it after drawing, since only this frame's requests count.
+	bool update()
+	{
+		bool changed = uploadFinished();
+		if (suspended)
+			return changed;
+
+		// Follow the requests, dropping finer levels only after a while
+		for (StreamedTexture& tex : textures) {
+			int wanted = tex.lastUsedFrame == frame ? tex.frameRequest : tex.mipCount - 1;
+			if (wanted < tex.targetLevel) {
+				tex.targetLevel = wanted;
+				tex.shrinkFrames = 0;
+			}
+			else if (wanted > tex.targetLevel && ++tex.shrinkFrames > textureShrinkDelayFrames) {
+				tex.targetLevel = wanted;
+				tex.shrinkFrames = 0;
+			}
+			else if (wanted == tex.targetLevel)
+				tex.shrinkFrames = 0;
+			tex.frameRequest = tex.mipCount - 1;
+		}
+
+		// Over budget: drop the finest level of the least recently used texture until it fits
+		size_t total = 0;
+		for (const StreamedTexture& tex : textures)
+			total += mipChainBytes(tex.fullWidth, tex.fullHeight, tex.targetLevel, tex.mipCount);
+		if (total > textureBudgetBytes) {
+			// Oldest texture on top, its finest level first when several are equally old
+			auto evictLater = [](const StreamedTexture* a, const StreamedTexture* b) {
+				if (a->lastUsedFrame != b->lastUsedFrame)
+					return a->lastUsedFrame > b->lastUsedFrame;
+				return a->targetLevel > b->targetLevel;
+			};
+			priority_queue<StreamedTexture*, vector<StreamedTexture*>, decltype(evictLater)> victims(evictLater);
+			for (StreamedTexture& tex : textures)
+				if (tex.targetLevel < tex.mipCount - 1)
+					victims.push(&tex);
+
+			while (total > textureBudgetBytes && !victims.empty()) {
+				StreamedTexture* victim = victims.top();
+				victims.pop();
+				total -= mipChainBytes(victim->fullWidth, victim->fullHeight, victim->targetLevel, victim->mipCount)
+					- mipChainBytes(victim->fullWidth, victim->fullHeight, victim->targetLevel + 1, victim->mipCount);
+				victim->targetLevel++;
+				if (victim->targetLevel < victim->mipCount - 1)
+					victims.push(victim);
+			}
+		}
+
+		// Queue stream jobs for textures that are not at their target
+		for (size_t i = 0; i < textures.size(); i++) {
+			StreamedTexture& tex = textures[i];
+			if (tex.loading || tex.targetLevel == tex.residentLevel)
+				continue;
+
+			tex.loading = true;
+			string path = tex.path;
+			int index = (int)i, firstLevel = tex.targetLevel;
+			workers.submit([this, path, index, firstLevel] {
+				int imageWidth = 0, imageHeight = 0;
+				shared_ptr<const vector<unsigned char>> source = decodeSource(path, imageWidth, imageHeight);
+				TextureStreamResult result = buildLevels(source.get(), imageWidth, imageHeight, index, firstLevel);
+				{
+					lock_guard<mutex> lock(resultMutex);
+					results.push_back(move(result));
+				}
+				glfwPostEmptyEvent(); // Wake the render loop if it is waiting for events
+			});
+		}
+
+		frame++;
+		return changed;
+	}
+
+	// Make every texture fully resident right away, ignoring the budget, and hold it there
+	// until resumeStreaming() (offline renders)
+	void loadFullResolution()
+	{
+		workers.wait();
+		uploadFinished();
+		suspended = true;
+		for (size_t i = 0; i < textures.size(); i++) {
+			StreamedTexture& tex = textures[i];
+			if (tex.residentLevel == 0)
+				continue;
+			int imageWidth = 0, imageHeight = 0;
+			shared_ptr<const vector<unsigned char>> source = decodeSource(tex.path, imageWidth, imageHeight);
+			TextureStreamResult result = buildLevels(source.get(), imageWidth, imageHeight, (int)i, 0);
+			upload(result);
+			tex.targetLevel = 0;
+			tex.shrinkFrames = 0;
+		}
+	}
+
+	// Go back to following the per-frame requests after loadFullResolution()
+	void resumeStreaming() { suspended = false; }
+
+	// Stop streaming and free every texture (call while the context is current)
+	void shutdown()
+	{
+		workers.stop();
+		for (StreamedTexture& tex : textures)
+			tex.texture.release();
+	}
+
+	size_t residentBytes() const
+	{
+		size_t total = 0;
+		for (const StreamedTexture& tex : textures)
+			total += tex.texture.bytes;
+		return total;
+	}
+
+	void report() const
+	{
+		for (const StreamedTexture& tex : textures)
+			cout << "  " << tex.path << ": " << tex.fullWidth << "x" << tex.fullHeight << " resident from mip "
+			<< tex.residentLevel << " (target " << tex.targetLevel << "), " << tex.texture.bytes / 1024 << " KB" << endl;
+		cout << "  Streamed textures: " << residentBytes() / 1024 << " KB of " << textureBudgetBytes / 1024 << " KB budget" << endl;
+		lock_guard<mutex> lock(sourceMutex);
+		cout << "  Decoded images in RAM: " << sources.size() << ", " << sourceBytes / 1024 << " KB of "
+			<< textureSourceCacheBytes / 1024 << " KB cache" << endl;
+	}
+
+private:
+	// Decoded RGB image of a file, null if it cannot be read. Recently used images stay cached
+	// within textureSourceCacheBytes so stream jobs rarely go back to the file; safe from workers.
+	shared_ptr<const vector<unsigned char>> decodeSource(const string& path, int& imageWidth, int& imageHeight)
+	{
+		{
+			lock_guard<mutex> lock(sourceMutex);
+			auto found = sourceIndex.find(path);
+			if (found != sourceIndex.end()) {
+				sources.splice(sources.begin(), sources, found->second); // Most recently used first
+				imageWidth = found->second->width;
+				imageHeight = found->second->height;
+				return found->second->pixels;
+			}
+		}
+
+		unsigned char* image = SOIL_load_image(path.c_str(), &imageWidth, &imageHeight, 0, SOIL_LOAD_RGB);
+		if (!image) {
+			cout << "Failed to load texture " << path << endl;
+			return nullptr;
+		}
+		auto pixels = make_shared<const vector<unsigned char>>(image, image + (size_t)imageWidth * imageHeight * 3);
+		SOIL_free_image_data(image);
+
+		// Jobs still holding an evicted image keep it alive until they finish
+		lock_guard<mutex> lock(sourceMutex);
+		if (sourceIndex.find(path) == sourceIndex.end()) {
+			sources.push_front({ path, imageWidth, imageHeight, pixels });
+			sourceIndex[path] = sources.begin();
+			sourceBytes += pixels->size();
+			while (sourceBytes > textureSourceCacheBytes && !sources.empty()) {
+				sourceBytes -= sources.back().pixels->size();
+				sourceIndex.erase(sources.back().path);
+				sources.pop_back();
+			}
+		}
+		return pixels;
+	}
+
+	// Build levels [firstLevel, mipCount) from the decoded image; firstLevel -1 picks the initial coarse level
+	static TextureStreamResult buildLevels(const vector<unsigned char>* source, int imageWidth, int imageHeight, int index, int firstLevel)
+	{
+		TextureStreamResult result;
+		result.textureIndex = index;
+
+		if (!source) {
+			// Image failed to load: fall back to a single white texel
+			result.firstLevel = 0;
+			result.levels.push_back(vector<unsigned char>(3, 255));
+			result.widths.assign(2, 1);
+			result.heights.assign(2, 1);
+			return result;
+		}
+
+		vector<unsigned char> level = *source;
+
+		int levelWidth = imageWidth, levelHeight = imageHeight;
+		for (int i = 0; ; i++) {
+			bool coarseEnough = firstLevel < 0 ? max(levelWidth, levelHeight) <= initialTextureSize : i >= firstLevel;
+			if (coarseEnough) {
+				if (result.levels.empty())
+					result.firstLevel = i;
+				result.levels.push_back(level);
+				result.widths.push_back(levelWidth);
+				result.heights.push_back(levelHeight);
+			}
+			if (levelWidth == 1 && levelHeight == 1)
+				break;
+
+			int nextWidth, nextHeight;
+			level = downsampleImage(level, levelWidth, levelHeight, 3, nextWidth, nextHeight);
+			levelWidth = nextWidth;
+			levelHeight = nextHeight;
+		}
+
+		// Full size goes in front of the level sizes
+		result.widths.insert(result.widths.begin(), imageWidth);
+		result.heights.insert(result.heights.begin(), imageHeight);
+		return result;
+	}
+
+	// Replace the texture's GL storage with the decoded levels
+	void upload(TextureStreamResult& result)
+	{
+		StreamedTexture& tex = textures[result.textureIndex];
+		tex.fullWidth = result.widths[0];
+		tex.fullHeight = result.heights[0];
+		tex.mipCount = mipLevelCount(tex.fullWidth, tex.fullHeight);
+
+		GLHandle texture(GLObjectType::Texture);
+		glState.bindTexture(GL_TEXTURE_2D, texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		size_t bytes = 0;
+		for (size_t i = 0; i < result.levels.size(); i++) {
+			int levelWidth = result.widths[i + 1], levelHeight = result.heights[i + 1];
+			glTexImage2D(GL_TEXTURE_2D, (GLint)i, GL_RGB, levelWidth, levelHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, result.levels[i].data());
+			bytes += (size_t)levelWidth * levelHeight * 4;
+		}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)result.levels.size() - 1);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glState.bindTexture(GL_TEXTURE_2D, 0);
+		texture.trackBytes(bytes);
+
+		tex.texture = move(texture);
+		tex.residentLevel = result.firstLevel;
+		if (!tex.loading)
+			tex.targetLevel = result.firstLevel;
+		tex.frameRequest = tex.mipCount - 1;
+		tex.loading = false;
+	}
+
+	struct DecodedSource {
+		string path;
+		int width, height;
+		shared_ptr<const vector<unsigned char>> pixels;
+	};
+
+	vector<StreamedTexture> textures;
+	vector<TextureStreamResult> results;
+	mutex resultMutex;
+	list<DecodedSource> sources; // Most recently used first
+	unordered_map<string, list<DecodedSource>::iterator> sourceIndex;
+	size_t sourceBytes = 0;
+	mutable mutex sourceMutex;
+	unsigned long long frame = 1;
+	bool suspended = false; // Set while an offline render needs every level resident
+	WorkerPool workers; // Declared last so the threads are joined before the queues go away
+};
+
+// Single streamer shared by the render loop and the memory report
+TextureStreamer* textureStreamer = nullptr;
+
+
+// Offscreen color and depth target the scene renders into before it is upscaled
+class RenderTarget
+{
+public:
+	// Allocate for the full window size; scaled frames use the lower left part of it
+	void resize(int targetWidth, int targetHeight)
+	{
+		targetWidth = max(1, targetWidth);
+		targetHeight = max(1, targetHeight);
+		if (targetWidth == allocWidth && targetHeight == allocHeight)
+			return;
+
+		color = GLHandle(GLObjectType::Texture);
+		glState.bindTexture(GL_TEXTURE_2D, color);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, targetWidth, targetHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glState.bindTexture(GL_TEXTURE_2D, 0);
+		color.trackBytes((size_t)targetWidth * targetHeight * 4);
+
+		depth = GLHandle(GLObjectType::Renderbuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, depth);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, targetWidth, targetHeight);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		depth.trackBytes((size_t)targetWidth * targetHeight * 4);
+
+		framebuffer = GLHandle(GLObjectType::Framebuffer);
+		glState.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			cout << "Offscreen framebuffer is incomplete!" << endl;
+		glState.bindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		allocWidth = targetWidth;
+		allocHeight = targetHeight;
+	}
+
+	void release()
+	{
+		framebuffer.release();
+		color.release();
+		depth.release();
+		allocWidth = allocHeight = 0;
+	}
+
+	GLHandle framebuffer, color, depth;
+	int allocWidth = 0, allocHeight = 0;
+};
+
+
+// Measures GPU frame time with a ring of timer queries so reading results never stalls
+class GpuFrameTimer
+{
+public:
+	static const int queryCount = 4;
+
+	void create()
+	{
+		for (int i = 0; i < queryCount; i++)
+			queries[i] = GLHandle(GLObjectType::Query);
+	}
+
+	void begin()
+	{
+		// The query being reused was issued queryCount frames ago, so its result is normally ready;
+		// when the GPU is further behind, skip the sample rather than wait for it
+		GLHandle& query = queries[frameIndex % queryCount];
+		hasResult = false;
+		if (issued[frameIndex % queryCount]) {
+			GLuint available = GL_FALSE;
+			glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available) {
+				GLuint64 elapsed = 0;
+				glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+				lastMs = elapsed / 1000000.0f;
+				hasResult = true;
+			}
+		}
+		glBeginQuery(GL_TIME_ELAPSED, query);
+	}
+
+	void end()
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		issued[frameIndex % queryCount] = true;
+		frameIndex++;
+	}
+
+	void release()
+	{
+		for (int i = 0; i < queryCount; i++) {
+			queries[i].release();
+			issued[i] = false;
+		}
+	}
+
+	GLHandle queries[queryCount];
+	bool issued[queryCount] = {};
+	unsigned long long frameIndex = 0;
+	float lastMs = 0.0f;
+	bool hasResult = false; // lastMs was read in this frame's begin()
+};
+
+// Encode an RGBA image as QOI (https://qoiformat.org), dropping alpha
+static void encodeQoi(const unsigned char* pixels, int imageWidth, int imageHeight, vector<unsigned char>& out)
+{
+	out.clear();
+	const unsigned char header[] = { 'q', 'o', 'i', 'f',
+		(unsigned char)(imageWidth >> 24), (unsigned char)(imageWidth >> 16), (unsigned char)(imageWidth >> 8), (unsigned char)imageWidth,
+		(unsigned char)(imageHeight >> 24), (unsigned char)(imageHeight >> 16), (unsigned char)(imageHeight >> 8), (unsigned char)imageHeight,
+		3, 0 };
+	out.insert(out.end(), header, header + sizeof(header));
+
+	unsigned char seen[64][4] = {}; // Alpha starts at 0 so unused entries never match an opaque pixel
+	unsigned char prev[3] = { 0, 0, 0 };
+	int run = 0;
+	size_t pixelCount = (size_t)imageWidth * imageHeight;
+
+	for (size_t i = 0; i < pixelCount; i++) {
+		const unsigned char* px = pixels + i * 4;
+		if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2]) {
+			run++;
+			if (run == 62 || i == pixelCount - 1) {
+				out.push_back((unsigned char)(0xC0 | (run - 1)));
+				run = 0;
+			}
+			continue;
+		}
+		if (run > 0) {
+			out.push_back((unsigned char)(0xC0 | (run - 1)));
+			run = 0;
+		}
+
+		int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+		if (seen[hash][0] == px[0] && seen[hash][1] == px[1] && seen[hash][2] == px[2] && seen[hash][3] == 255)
+			out.push_back((unsigned char)hash);
+		else {
+			memcpy(seen[hash], px, 3);
+			seen[hash][3] = 255;
+			int dr = (signed char)(px[0] - prev[0]), dg = (signed char)(px[1] - prev[1]), db = (signed char)(px[2] - prev[2]);
+			int drg = dr - dg, dbg = db - dg;
+			if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2)
+				out.push_back((unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+			else if (drg > -9 && drg < 8 && dg > -33 && dg < 32 && dbg > -9 && dbg < 8) {
+				out.push_back((unsigned char)(0x80 | (dg + 32)));
+				out.push_back((unsigned char)((drg + 8) << 4 | (dbg + 8)));
+			}
+			else {
+				out.push_back(0xFE);
+				out.insert(out.end(), px, px + 3);
+			}
+		}
+		memcpy(prev, px, 3);
+	}
+
+	const unsigned char end[] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	out.insert(out.end(), end, end + sizeof(end));
+}
+
+// Flip an image in place so the first row is the top one (GL reads bottom-up)
+static void flipRows(unsigned char* pixels, int rowBytes, int rows)
+{
+	for (int y = 0; y < rows / 2; y++)
+		swap_ranges(pixels + (size_t)y * rowBytes, pixels + (size_t)(y + 1) * rowBytes, pixels + (size_t)(rows - 1 - y) * rowBytes);
+}
+
+// "capture_000042.png" style names
+static string captureFileName(int frameNumber, const string& extension)
+{
+	string number = to_string(frameNumber);
+	return "capture_" + string(number.size() < 6 ? 6 - number.size() : 0, '0') + number + "." + extension;
+}
+
+
+// CPU buffers handed between the render thread and workers. The pool grows to a limit,
+// then acquire() waits for a worker to release one, so steady-state use never allocates.
+class BufferPool
+{
+public:
+	// Drop every buffer (none may be in use) and start over with a new size
+	void reset(size_t newBufferBytes, int newMaxBuffers)
+	{
+		lock_guard<mutex> lock(poolMutex);
+		freeBuffers.clear();
+		buffers.clear();
+		bufferBytes = newBufferBytes;
+		maxBuffers = newMaxBuffers;
+	}
+
+	vector<unsigned char>* acquire()
+	{
+		unique_lock<mutex> lock(poolMutex);
+		if (freeBuffers.empty() && (int)buffers.size() < maxBuffers) {
+			buffers.emplace_back(new vector<unsigned char>(bufferBytes));
+			return buffers.back().get();
+		}
+		bufferReturned.wait(lock, [this] { return !freeBuffers.empty(); });
+		vector<unsigned char>* buffer = freeBuffers.back();
+		freeBuffers.pop_back();
+		return buffer;
+	}
+
+	void release(vector<unsigned char>* buffer)
+	{
+		{
+			lock_guard<mutex> lock(poolMutex);
+			freeBuffers.push_back(buffer);
+		}
+		bufferReturned.notify_one();
+	}
+
+private:
+	vector<unique_ptr<vector<unsigned char>>> buffers;
+	vector<vector<unsigned char>*> freeBuffers;
+	size_t bufferBytes = 0;
+	int maxBuffers = 1;
+	mutex poolMutex;
+	condition_variable bufferReturned;
+};
+
+
+// Records the window to image files or Y4M video without stalling the render loop.
+// Frames are read into a ring of pixel buffers, mapped a few frames later once their
+// fence has signaled, and encoded on worker threads from a fixed pool of CPU buffers.
+class FrameCapture
+{
+public:
+	FrameCapture() : encoders(max(2u, thread::hardware_concurrency()) - 1), videoWriter(1) {}
+
+	bool active() const { return capturing; }
+
+	void start(int frameWidth, int frameHeight, CaptureFormat outputFormat)
+	{
+		captureWidth = max(1, frameWidth);
+		captureHeight = max(1, frameHeight);
+		frameBytes = (size_t)captureWidth * captureHeight * 4;
+		format = outputFormat;
+
+		for (Slot& slot : slots) {
+			slot.pbo = GLHandle(GLObjectType::Buffer);
+			slot.pbo.bufferData(GL_PIXEL_PACK_BUFFER, frameBytes, nullptr, GL_STREAM_READ);
+		}
+		glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		framePool.reset(frameBytes, maxCaptureBuffers);
+
+		if (format == CaptureFormat::Y4M) {
+			video.open("capture.y4m", ios::binary);
+			video << "YUV4MPEG2 W" << captureWidth << " H" << captureHeight << " F" << captureVideoFps << ":1 Ip A1:1 C420jpeg\n";
+		}
+
+		nextSlot = 0;
+		framesCaptured = 0;
+		captureSeconds = 0.0;
+		capturing = true;
+		cout << "Capture started (" << captureWidth << "x" << captureHeight << ")" << endl;
+	}
+
+	// Read back the frame just drawn to the back buffer (call before swapping)
+	void captureFrame(int frameWidth, int frameHeight)
+	{
+		if (!capturing)
+			return;
+		if (frameWidth != captureWidth || frameHeight != captureHeight) {
+			cout << "Window size changed, stopping capture" << endl;
+			stop();
+			return;
+		}
+
+		double startTime = glfwGetTime();
+
+		// Ring is full: the oldest readback has to be collected before its buffer is reused
+		Slot& slot = slots[nextSlot];
+		if (slot.fence)
+			collect(slot, true);
+
+		glState.bindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		glReadBuffer(GL_BACK);
+		glReadPixels(0, 0, captureWidth, captureHeight, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		slot.fence.insert();
+		slot.frameNumber = framesCaptured++;
+		nextSlot = (nextSlot + 1) % capturePboCount;
+
+		// Hand finished readbacks to the encoders, oldest first so video frames stay in order
+		for (int i = 0; i < capturePboCount; i++) {
+			Slot& older = slots[(nextSlot + i) % capturePboCount];
+			if (!older.fence)
+				continue;
+			if (!collect(older, false))
+				break;
+		}
+
+		captureSeconds += glfwGetTime() - startTime;
+	}
+
+	// Collect outstanding readbacks and wait for the encoders to finish
+	void stop()
+	{
+		if (!capturing)
+			return;
+
+		for (int i = 0; i < capturePboCount; i++) {
+			Slot& slot = slots[(nextSlot + i) % capturePboCount];
+			if (slot.fence)
+				collect(slot, true);
+		}
+		encoders.wait();
+		videoWriter.wait();
+		if (video.is_open())
+			video.close();
+		for (Slot& slot : slots)
+			slot.pbo.release();
+
+		capturing = false;
+		cout << "Capture stopped: " << framesCaptured << " frames, "
+			<< (framesCaptured ? captureSeconds * 1000.0 / framesCaptured : 0.0) << " ms per frame on the render thread" << endl;
+	}
+
+	void shutdown()
+	{
+		stop();
+		encoders.stop();
+		videoWriter.stop();
+	}
+
+private:
+	struct Slot {
+		GLHandle pbo;
+		GLFence fence;
+		int frameNumber = 0;
+	};
+
+	// Map a finished readback into a pooled buffer and queue it for encoding
+	bool collect(Slot& slot, bool waitForGpu)
+	{
+		if (!slot.fence.wait(waitForGpu ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, waitForGpu ? 1000000000ull : 0) && !waitForGpu)
+			return false;
+		slot.fence.release();
+
+		vector<unsigned char>* frame = framePool.acquire();
+		glState.bindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameBytes, GL_MAP_READ_BIT);
+		if (pixels) {
+			memcpy(frame->data(), pixels, frameBytes);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		int frameNumber = slot.frameNumber;
+		WorkerPool& pool = format == CaptureFormat::Y4M ? videoWriter : encoders; // Video frames must be written in order
+		pool.submit([this, frame, frameNumber] {
+			encode(*frame, frameNumber);
+			framePool.release(frame);
+		});
+		return true;
+	}
+
+	// Runs on a worker thread
+	void encode(vector<unsigned char>& frame, int frameNumber)
+	{
+		int rowBytes = captureWidth * 4;
+		if (format == CaptureFormat::PNG) {
+			flipRows(frame.data(), rowBytes, captureHeight);
+			SOIL_save_image(captureFileName(frameNumber, "png").c_str(), SOIL_SAVE_TYPE_PNG, captureWidth, captureHeight, 4, frame.data());
+		}
+		else if (format == CaptureFormat::QOI) {
+			static thread_local vector<unsigned char> encoded;
+			flipRows(frame.data(), rowBytes, captureHeight);
+			encodeQoi(frame.data(), captureWidth, captureHeight, encoded);
+			ofstream file(captureFileName(frameNumber, "qoi"), ios::binary);
+			file.write((const char*)encoded.data(), encoded.size());
+		}
+		else
+			writeY4mFrame(frame);
+	}
+
+	// BT.601 studio-range 4:2:0 conversion; only ever runs on the single video thread
+	void writeY4mFrame(const vector<unsigned char>& frame)
+	{
+		int chromaWidth = (captureWidth + 1) / 2, chromaHeight = (captureHeight + 1) / 2;
+		yuv.resize((size_t)captureWidth * captureHeight + 2 * (size_t)chromaWidth * chromaHeight);
+		unsigned char* yPlane = yuv.data();
+		unsigned char* uPlane = yPlane + (size_t)captureWidth * captureHeight;
+		unsigned char* vPlane = uPlane + (size_t)chromaWidth * chromaHeight;
+
+		for (int y = 0; y < captureHeight; y++) {
+			const unsigned char* row = frame.data() + (size_t)(captureHeight - 1 - y) * captureWidth * 4;
+			for (int x = 0; x < captureWidth; x++) {
+				const unsigned char* px = row + x * 4;
+				yPlane[(size_t)y * captureWidth + x] = (unsigned char)(((66 * px[0] + 129 * px[1] + 25 * px[2] + 128) >> 8) + 16);
+			}
+		}
+		for (int cy = 0; cy < chromaHeight; cy++) {
+			for (int cx = 0; cx < chromaWidth; cx++) {
+				int r = 0, g = 0, b = 0;
+				for (int k = 0; k < 4; k++) {
+					int x = min(cx * 2 + (k & 1), captureWidth - 1), y = min(cy * 2 + (k >> 1), captureHeight - 1);
+					const unsigned char* px = frame.data() + ((size_t)(captureHeight - 1 - y) * captureWidth + x) * 4;
+					r += px[0]; g += px[1]; b += px[2];
+				}
+				r /= 4; g /= 4; b /= 4;
+				uPlane[(size_t)cy * chromaWidth + cx] = (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+				vPlane[(size_t)cy * chromaWidth + cx] = (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+			}
+		}
+
+		video << "FRAME\n";
+		video.write((const char*)yuv.data(), yuv.size());
+	}
+
+	Slot slots[capturePboCount];
+	int nextSlot = 0;
+	int captureWidth = 0, captureHeight = 0;
+	size_t frameBytes = 0;
+	CaptureFormat format = CaptureFormat::QOI;
+	bool capturing = false;
+	int framesCaptured = 0;
+	double captureSeconds = 0.0;
+
+	BufferPool framePool;
+	ofstream video;
+	vector<unsigned char> yuv;
+
+	// Declared last so the threads are joined before the buffers they use go away
+	WorkerPool encoders;
+	WorkerPool videoWriter;
+};
+
+
+// Writes an uncompressed RGB tiled TIFF. Tiles must arrive in row-major order and are
+// appended as they come, so only the tile being written is ever held in memory.
+class TiledTiffWriter
+{
+public:
+	bool open(const string& path, int imageWidth, int imageHeight, int tileSize)
+	{
+		columns = (imageWidth + tileSize - 1) / tileSize;
+		rows = (imageHeight + tileSize - 1) / tileSize;
+		tileBytes = (size_t)tileSize * tileSize * 3;
+		int tileCount = columns * rows;
+
+		// Header, one IFD with 11 entries, then BitsPerSample, offsets and byte counts
+		const unsigned entryCount = 11;
+		unsigned bitsOffset = 8 + 2 + entryCount * 12 + 4;
+		unsigned offsetsOffset = bitsOffset + 6;
+		unsigned countsOffset = offsetsOffset + tileCount * 4;
+		unsigned long long dataOffset = countsOffset + tileCount * 4ull;
+		if (dataOffset + tileBytes * tileCount > 0xFFFFFFFFull) {
+			cout << "Poster is too large for a 32-bit TIFF" << endl;
+			return false;
+		}
+
+		vector<unsigned char> header;
+		auto put16 = [&](unsigned value) { header.push_back(value & 0xFF); header.push_back((value >> 8) & 0xFF); };
+		auto put32 = [&](unsigned value) { put16(value & 0xFFFF); put16(value >> 16); };
+		auto entry = [&](unsigned tag, unsigned type, unsigned count, unsigned value) { put16(tag); put16(type); put32(count); put32(value); };
+		const unsigned SHORT = 3, LONG = 4;
+
+		header.push_back('I'); header.push_back('I'); put16(42); put32(8);
+		put16(entryCount);
+		entry(256, LONG, 1, imageWidth);
+		entry(257, LONG, 1, imageHeight);
+		entry(258, SHORT, 3, bitsOffset); // BitsPerSample 8,8,8
+		entry(259, SHORT, 1, 1); // No compression
+		entry(262, SHORT, 1, 2); // RGB
+		entry(277, SHORT, 1, 3); // Samples per pixel
+		entry(284, SHORT, 1, 1); // Interleaved
+		entry(322, LONG, 1, tileSize);
+		entry(323, LONG, 1, tileSize);
+		entry(324, LONG, tileCount, tileCount == 1 ? (unsigned)dataOffset : offsetsOffset); // Single values are stored inline
+		entry(325, LONG, tileCount, tileCount == 1 ? (unsigned)tileBytes : countsOffset);
+		put32(0); // No further IFDs
+		put16(8); put16(8); put16(8);
+		for (int i = 0; i < tileCount; i++)
+			put32((unsigned)(dataOffset + tileBytes * i));
+		for (int i = 0; i < tileCount; i++)
+			put32((unsigned)tileBytes);
+
+		file.open(path, ios::binary);
+		file.write((const char*)header.data(), header.size());
+		nextTile = 0;
+		return file.good();
+	}
+
+	// tileSize x tileSize RGB pixels, top row first; edge tiles are padded
+	void writeTile(int tileIndex, const unsigned char* rgb)
+	{
+		if (tileIndex != nextTile++)
+			cout << "Poster tile " << tileIndex << " written out of order" << endl;
+		file.write((const char*)rgb, tileBytes);
+	}
+
+	bool close()
+	{
+		file.close();
+		return !file.fail();
+	}
+
+	int columns = 0, rows = 0;
+
+private:
+	ofstream file;
+	size_t tileBytes = 0;
+	int nextTile = 0;
+};
+
+// Render the scene far beyond framebuffer limits by drawing it tile by tile with off-center
+// sub-frustums of the normal projection. While one tile renders, the previous one is read
+// back and written by a worker, so memory stays at two tiles whatever the poster size.
+// viewAspect is the on-screen projection's aspect; a poster of another shape crops that view.
+void renderPoster(const function<void(const glm::mat4&)>& drawScene, const string& path, float viewAspect)
+{
+	const int tileSize = posterTileSize;
+	TiledTiffWriter tiff;
+	if (!tiff.open(path, posterWidth, posterHeight, tileSize))
+		return;
+
+	double startTime = glfwGetTime();
+	int tileCount = tiff.columns * tiff.rows;
+	size_t readbackBytes = (size_t)tileSize * tileSize * 4;
+
+	RenderTarget tileTarget;
+	tileTarget.resize(tileSize, tileSize);
+	GLHandle pbos[2];
+	GLFence fences[2];
+	int pboTile[2] = { 0, 0 };
+	for (GLHandle& pbo : pbos) {
+		pbo = GLHandle(GLObjectType::Buffer);
+		pbo.bufferData(GL_PIXEL_PACK_BUFFER, readbackBytes, nullptr, GL_STREAM_READ);
+	}
+	glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	BufferPool tileBuffers;
+	tileBuffers.reset(readbackBytes, 2);
+	WorkerPool writer(1);
+
+	// Same frustum glm::perspective builds from fov for the window, cropped to the poster's
+	// aspect around its center and split up per tile
+	float top = projectionNear * tan(fov / 2.0f);
+	float right = top * viewAspect;
+	float posterAspect = (GLfloat)posterWidth / (GLfloat)posterHeight;
+	if (posterAspect > viewAspect)
+		top = right / posterAspect; // Wider poster: keep the full width, crop top and bottom
+	else
+		right = top * posterAspect; // Taller poster: keep the full height, crop the sides
+
+	auto tileRect = [&](int tileIndex, int& x0, int& y0, int& tileWidth, int& tileHeight) {
+		x0 = (tileIndex % tiff.columns) * tileSize;
+		y0 = (tileIndex / tiff.columns) * tileSize; // From the top, as TIFF stores tiles
+		tileWidth = min(tileSize, posterWidth - x0);
+		tileHeight = min(tileSize, posterHeight - y0);
+	};
+
+	// Map a finished readback and queue the tile for writing
+	auto collect = [&](int slot) {
+		fences[slot].wait(GL_SYNC_FLUSH_COMMANDS_BIT, 10000000000ull);
+		fences[slot].release();
+
+		vector<unsigned char>* pixels = tileBuffers.acquire();
+		glState.bindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+		void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readbackBytes, GL_MAP_READ_BIT);
+		if (mapped) {
+			memcpy(pixels->data(), mapped, readbackBytes);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		int tileIndex = pboTile[slot], x0, y0, tileWidth, tileHeight;
+		tileRect(tileIndex, x0, y0, tileWidth, tileHeight);
+		writer.submit([&tiff, &tileBuffers, pixels, tileIndex, tileWidth, tileHeight, tileSize] {
+			// Bottom-up RGBA to top-down RGB, padded to the full tile
+			static thread_local vector<unsigned char> rgb;
+			rgb.assign((size_t)tileSize * tileSize * 3, 0);
+			for (int y = 0; y < tileHeight; y++) {
+				const unsigned char* src = pixels->data() + (size_t)(tileHeight - 1 - y) * tileWidth * 4;
+				unsigned char* dst = rgb.data() + (size_t)y * tileSize * 3;
+				for (int x = 0; x < tileWidth; x++) {
+					dst[x * 3] = src[x * 4];
+					dst[x * 3 + 1] = src[x * 4 + 1];
+					dst[x * 3 + 2] = src[x * 4 + 2];
+				}
+			}
+			tiff.writeTile(tileIndex, rgb.data());
+			tileBuffers.release(pixels);
+		});
+	};
+
+	int savedRenderWidth = renderWidth, savedRenderHeight = renderHeight;
+	glState.bindFramebuffer(GL_FRAMEBUFFER, tileTarget.framebuffer);
+	glState.enable(GL_DEPTH_TEST);
+
+	for (int tileIndex = 0; tileIndex < tileCount; tileIndex++) {
+		int x0, y0, tileWidth, tileHeight;
+		tileRect(tileIndex, x0, y0, tileWidth, tileHeight);
+
+		// Off-center frustum covering just this tile (GL's y runs bottom-up)
+		float yBottom = (GLfloat)(posterHeight - y0 - tileHeight), yTop = (GLfloat)(posterHeight - y0);
+		glm::mat4 tileProjection = glm::frustum(
+			-right + 2.0f * right * x0 / posterWidth, -right + 2.0f * right * (x0 + tileWidth) / posterWidth,
+			-top + 2.0f * top * yBottom / posterHeight, -top + 2.0f * top * yTop / posterHeight,
+			projectionNear, projectionFar);
+
+		renderWidth = tileWidth;
+		renderHeight = tileHeight;
+		glState.bindFramebuffer(GL_FRAMEBUFFER, tileTarget.framebuffer);
+		glViewport(0, 0, tileWidth, tileHeight);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		drawScene(tileProjection);
+
+		int slot = tileIndex % 2;
+		glState.bindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glReadPixels(0, 0, tileWidth, tileHeight, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		fences[slot].insert();
+		pboTile[slot] = tileIndex;
+
+		// The previous tile is read back and written while this one renders
+		if (fences[1 - slot])
+			collect(1 - slot);
+
+		if ((tileIndex + 1) % tiff.columns == 0)
+			cout << "Poster: " << (tileIndex + 1) * 100 / tileCount << "%" << endl;
+	}
+	for (int slot = 0; slot < 2; slot++)
+		if (fences[slot])
+			collect(slot);
+
+	writer.stop();
+	bool written = tiff.close();
+	glState.bindFramebuffer(GL_FRAMEBUFFER, 0);
+	renderWidth = savedRenderWidth;
+	renderHeight = savedRenderHeight;
+
+	if (written)
+		cout << "Wrote " << path << " (" << posterWidth << "x" << posterHeight << ", " << tileCount << " tiles) in " << glfwGetTime() - startTime << " s" << endl;
+	else
+		cout << "Failed to write " << path << endl;
+}
+
+
+// Adjust the render scale so the measured GPU time approaches the budget
+void updateRenderScale(const GpuFrameTimer& timer)
+{
+	if (!dynamicResolution) {
+		renderScale = maxRenderScale;
+		return;
+	}
+	if (!timer.hasResult || timer.lastMs <= 0.0f)
+		return;
+
+	// Ignore small errors so the scale does not hunt around the target
+	float error = timer.lastMs / targetGpuFrameMs;
+	if (error > 0.95f && error < 1.05f)
+		return;
+
+	// Shading cost follows pixel count, i.e. the square of the scale
+	float desired = renderScale * sqrt(1.0f / error);
+	renderScale += (desired - renderScale) * (error > 1.0f ? 0.25f : 0.05f); // Drop quickly, recover slowly
+	renderScale = glm::clamp(renderScale, minRenderScale, maxRenderScale);
+}
+
+
+// Ray for scene queries; direction need not be normalized, distances are in its units
+struct Ray {
+	glm::vec3 origin, direction;
+	float maxDistance = FLT_MAX;
+};
+
+struct RayHit {
+	int instance = -1; // -1 when nothing was hit
+	int triangle = -1;
+	float distance = FLT_MAX;
+	float u = 0.0f, v = 0.0f; // Barycentrics of the hit on the triangle
+};
+
+// Axis aligned bounding box
+struct Bounds {
+	glm::vec3 lower = glm::vec3(FLT_MAX), upper = glm::vec3(-FLT_MAX);
+
+	void grow(const glm::vec3& point) { lower = glm::min(lower, point); upper = glm::max(upper, point); }
+	void grow(const Bounds& other) { lower = glm::min(lower, other.lower); upper = glm::max(upper, other.upper); }
+	glm::vec3 center() const { return (lower + upper) * 0.5f; }
+	float area() const
+	{
+		glm::vec3 size = glm::max(upper - lower, glm::vec3(0.0f));
+		return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+	}
+};
+
+// Four children per node, bounds stored per axis so one SSE slab test covers all of them.
+// count > 0: leaf holding primitives [child, child + count) of the order list
+// count == 0: inner node at nodes[child]; count < 0: empty slot
+struct Bvh4Node {
+	float minX[4], minY[4], minZ[4], maxX[4], maxY[4], maxZ[4];
+	int child[4];
+	int count[4];
+};
+
+// Binned SAH build of a binary tree, collapsed into 4-wide nodes. order receives the
+// primitive indices in leaf order. Returns the depth in 4-wide nodes, which traversal needs.
+static int buildBvh4(const vector<Bounds>& primBounds, vector<Bvh4Node>& nodes, vector<int>& order)
+{
+	struct BuildNode {
+		Bounds bounds;
+		int left = -1, right = -1;
+		int first = 0, count = 0;
+	};
+	vector<BuildNode> tree;
+	nodes.clear();
+	order.resize(primBounds.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = (int)i;
+	if (order.empty())
+		return 0;
+
+	function<int(int, int)> build = [&](int first, int count) -> int {
+		int index = (int)tree.size();
+		tree.emplace_back();
+		Bounds bounds, centers;
+		for (int i = first; i < first + count; i++) {
+			bounds.grow(primBounds[order[i]]);
+			centers.grow(primBounds[order[i]].center());
+		}
+		tree[index].bounds = bounds;
+		tree[index].first = first;
+		tree[index].count = count;
+		if (count <= bvhMaxLeafSize)
+			return index;
+
+		// Split along the widest centroid axis at the cheapest bin boundary
+		glm::vec3 extent = centers.upper - centers.lower;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		float axisMin = centers.lower[axis], axisSize = extent[axis];
+		int mid = first + count / 2;
+
+		if (axisSize > 0.0f) {
+			Bounds binBounds[bvhSahBins];
+			int binCounts[bvhSahBins] = {};
+			auto binOf = [&](int prim) {
+				return min(bvhSahBins - 1, (int)((primBounds[prim].center()[axis] - axisMin) / axisSize * bvhSahBins));
+			};
+			for (int i = first; i < first + count; i++) {
+				int bin = binOf(order[i]);
+				binCounts[bin]++;
+				binBounds[bin].grow(primBounds[order[i]]);
+			}
+
+			float bestCost = FLT_MAX;
+			int bestSplit = -1;
+			for (int split = 1; split < bvhSahBins; split++) {
+				Bounds left, right;
+				int leftCount = 0, rightCount = 0;
+				for (int b = 0; b < split; b++) { if (binCounts[b]) left.grow(binBounds[b]); leftCount += binCounts[b]; }
+				for (int b = split; b < bvhSahBins; b++) { if (binCounts[b]) right.grow(binBounds[b]); rightCount += binCounts[b]; }
+				if (leftCount == 0 || rightCount == 0)
+					continue;
+				float cost = left.area() * leftCount + right.area() * rightCount;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestSplit = split;
+				}
+			}
+			if (bestSplit > 0)
+				mid = (int)(partition(order.begin() + first, order.begin() + first + count,
+					[&](int prim) { return binOf(prim) < bestSplit; }) - order.begin());
+		}
+
+		// Identical centroids or no useful split: halve by position instead
+		if (mid == first || mid == first + count) {
+			mid = first + count / 2;
+			nth_element(order.begin() + first, order.begin() + mid, order.begin() + first + count,
+				[&](int a, int b) { return primBounds[a].center()[axis] < primBounds[b].center()[axis]; });
+		}
+
+		int left = build(first, mid - first);
+		int right = build(mid, first + count - mid);
+		tree[index].left = left;
+		tree[index].right = right;
+		return index;
+	};
+	build(0, (int)order.size());
+
+	// Pull grandchildren up until each node has four children
+	int depth = 0;
+	function<int(int, int)> collapse = [&](int treeIndex, int level) -> int {
+		depth = max(depth, level);
+		vector<int> children;
+		if (tree[treeIndex].left < 0)
+			children.push_back(treeIndex);
+		else {
+			children.push_back(tree[treeIndex].left);
+			children.push_back(tree[treeIndex].right);
+		}
+		while (children.size() < 4) {
+			int widest = -1;
+			for (int i = 0; i < (int)children.size(); i++)
+				if (tree[children[i]].left >= 0 && (widest < 0 || tree[children[i]].bounds.area() > tree[children[widest]].bounds.area()))
+					widest = i;
+			if (widest < 0)
+				break;
+			int expand = children[widest];
+			children[widest] = tree[expand].left;
+			children.push_back(tree[expand].right);
+		}
+
+		int nodeIndex = (int)nodes.size();
+		nodes.emplace_back();
+		for (int i = 0; i < 4; i++) {
+			Bvh4Node& node = nodes[nodeIndex];
+			if (i >= (int)children.size()) {
+				node.minX[i] = node.minY[i] = node.minZ[i] = node.maxX[i] = node.maxY[i] = node.maxZ[i] = 0.0f;
+				node.child[i] = 0;
+				node.count[i] = -1;
+				continue;
+			}
+			const BuildNode& child = tree[children[i]];
+			node.minX[i] = child.bounds.lower.x; node.minY[i] = child.bounds.lower.y; node.minZ[i] = child.bounds.lower.z;
+			node.maxX[i] = child.bounds.upper.x; node.maxY[i] = child.bounds.upper.y; node.maxZ[i] = child.bounds.upper.z;
+			if (child.left < 0) {
+				node.child[i] = child.first;
+				node.count[i] = child.count;
+			}
+			else {
+				int inner = collapse(children[i], level + 1); // May grow nodes, so node is looked up again next lane
+				nodes[nodeIndex].child[i] = inner;
+				nodes[nodeIndex].count[i] = 0;
+			}
+		}
+		return nodeIndex;
+	};
+	collapse(0, 1);
+	return depth;
+}
+
+// Walk a 4-wide BVH front to back. leafTest(first, count) tests primitives and lowers closest on a hit.
+// depth is what buildBvh4 returned for the tree.
+template <typename LeafTest>
+static void traverseBvh4(const vector<Bvh4Node>& nodes, int depth, const glm::vec3& origin, const glm::vec3& direction, const float& closest, LeafTest leafTest)
+{
+	if (nodes.empty())
+		return;
+
+	const __m128 originX = _mm_set1_ps(origin.x), originY = _mm_set1_ps(origin.y), originZ = _mm_set1_ps(origin.z);
+	const __m128 inverseX = _mm_set1_ps(1.0f / direction.x), inverseY = _mm_set1_ps(1.0f / direction.y), inverseZ = _mm_set1_ps(1.0f / direction.z);
+	const __m128 zero = _mm_setzero_ps();
+
+	// Each inner node visited replaces itself with at most four children, so the stack
+	// never holds more than 3 * depth + 1 entries; only unusually deep trees need the heap
+	int localStack[128];
+	vector<int> deepStack;
+	int* stack = localStack;
+	if (3 * depth + 1 > 128) {
+		deepStack.resize(3 * depth + 1);
+		stack = deepStack.data();
+	}
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+		const Bvh4Node& node = nodes[stack[--stackSize]];
+
+		// Slab test against all four children at once
+		__m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minX), originX), inverseX);
+		__m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxX), originX), inverseX);
+		__m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minY), originY), inverseY);
+		__m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxY), originY), inverseY);
+		__m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minZ), originZ), inverseZ);
+		__m128 z1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxZ), originZ), inverseZ);
+		__m128 entry = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)), _mm_max_ps(_mm_min_ps(z0, z1), zero));
+		__m128 exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)), _mm_min_ps(_mm_max_ps(z0, z1), _mm_set1_ps(closest)));
+		int hitMask = _mm_movemask_ps(_mm_cmple_ps(entry, exit));
+		if (!hitMask)
+			continue;
+
+		float entryDistance[4];
+		_mm_storeu_ps(entryDistance, entry);
+
+		// Nearest child first
+		int hits[4], hitCount = 0;
+		for (int i = 0; i < 4; i++) {
+			if (!(hitMask & (1 << i)) || node.count[i] < 0)
+				continue;
+			int slot = hitCount++;
+			while (slot > 0 && entryDistance[hits[slot - 1]] > entryDistance[i]) {
+				hits[slot] = hits[slot - 1];
+				slot--;
+			}
+			hits[slot] = i;
+		}
+
+		// Leaves are tested right away so closest shrinks before inner children are visited
+		for (int i = 0; i < hitCount; i++)
+			if (node.count[hits[i]] > 0 && entryDistance[hits[i]] <= closest)
+				leafTest(node.child[hits[i]], node.count[hits[i]]);
+		for (int i = hitCount - 1; i >= 0; i--)
+			if (node.count[hits[i]] == 0)
+				stack[stackSize++] = node.child[hits[i]];
+	}
+}
+
+// Moller-Trumbore ray/triangle test
+static bool intersectTriangle(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c,
+	float& distance, float& u, float& v)
+{
+	glm::vec3 edge1 = b - a, edge2 = c - a;
+	glm::vec3 p = glm::cross(direction, edge2);
+	float det = glm::dot(edge1, p);
+	if (fabs(det) < 1e-12f)
+		return false;
+	float inverseDet = 1.0f / det;
+	glm::vec3 s = origin - a;
+	u = glm::dot(s, p) * inverseDet;
+	if (u < 0.0f || u > 1.0f)
+		return false;
+	glm::vec3 q = glm::cross(s, edge1);
+	v = glm::dot(direction, q) * inverseDet;
+	if (v < 0.0f || u + v > 1.0f)
+		return false;
+	distance = glm::dot(edge2, q) * inverseDet;
+	return distance > 0.0f;
+}
+
+// Two-level BVH for ray queries: one bottom level tree per mesh over its triangles, built
+// once, and a top level tree over instances, rebuilt only when a transform changes.
+class SceneBvh
+{
+public:
+	// Add a mesh from interleaved vertices (position first) and a triangle index list
+	template <typename Index>
+	int addMesh(const GLfloat* meshVertices, int stride, const Index* triangles, int indexCount)
+	{
+		meshes.emplace_back();
+		BvhMesh& mesh = meshes.back();
+		int vertexCount = 0;
+		for (int i = 0; i < indexCount; i++)
+			vertexCount = max(vertexCount, (int)triangles[i] + 1);
+		for (int i = 0; i < vertexCount; i++)
+			mesh.positions.push_back(glm::vec3(meshVertices[i * stride], meshVertices[i * stride + 1], meshVertices[i * stride + 2]));
+		for (int i = 0; i < indexCount - indexCount % 3; i++)
+			mesh.indices.push_back((int)triangles[i]);
+
+		vector<Bounds> triangleBounds(mesh.indices.size() / 3);
+		for (size_t t = 0; t < triangleBounds.size(); t++)
+			for (int k = 0; k < 3; k++) {
+				triangleBounds[t].grow(mesh.positions[mesh.indices[t * 3 + k]]);
+				mesh.bounds.grow(mesh.positions[mesh.indices[t * 3 + k]]);
+			}
+		mesh.depth = buildBvh4(triangleBounds, mesh.nodes, mesh.order);
+		return (int)meshes.size() - 1;
+	}
+
+	int addInstance(int mesh, const string& name, const glm::mat4& model = glm::mat4(1.0f))
+	{
+		instances.emplace_back();
+		instances.back().mesh = mesh;
+		instances.back().name = name;
+		placeInstance(instances.back(), model);
+		return (int)instances.size() - 1;
+	}
+
+	// Move an instance; the top level is rebuilt on the next query only if something moved
+	void setTransform(int instance, const glm::mat4& model)
+	{
+		if (memcmp(&instances[instance].toWorld, &model, sizeof(glm::mat4)) != 0)
+			placeInstance(instances[instance], model);
+	}
 
+	const string& instanceName(int instance) const { return instances[instance].name; }
+	const glm::mat4& instanceTransform(int instance) const { return instances[instance].toWorld; }
+	const Bounds& instanceBounds(int instance) const { return instances[instance].worldBounds; }
+
+	// World space bounds of every instance
+	Bounds sceneBounds() const
+	{
+		Bounds bounds;
+		for (const BvhInstance& inst : instances)
+			bounds.grow(inst.worldBounds);
+		return bounds;
+	}
 
-// Create and Compile Shaders
-static GLuint CompileShader(const string& source, GLuint shaderType)
+	// Unnormalized world space geometric normal of a hit triangle (winding decides the sign)
+	glm::vec3 hitNormal(const RayHit& hit) const
+	{
+		const BvhInstance& inst = instances[hit.instance];
+		const BvhMesh& mesh = meshes[inst.mesh];
+		glm::vec3 a(inst.toWorld * glm::vec4(mesh.positions[mesh.indices[hit.triangle * 3]], 1.0f));
+		glm::vec3 b(inst.toWorld * glm::vec4(mesh.positions[mesh.indices[hit.triangle * 3 + 1]], 1.0f));
+		glm::vec3 c(inst.toWorld * glm::vec4(mesh.positions[mesh.indices[hit.triangle * 3 + 2]], 1.0f));
+		return glm::cross(b - a, c - a);
+	}
+
+	// Build the top level now so later queries only read shared state (for use from worker threads)
+	void prepareForQueries() { updateTopLevel(); }
+
+	// Closest hit along a ray
+	RayHit intersect(const Ray& ray)
+	{
+		updateTopLevel();
+		return intersectBuilt(ray);
+	}
+
+	// Closest hits for many rays, spread over worker threads
+	void intersect(const vector<Ray>& rays, vector<RayHit>& hits)
+	{
+		updateTopLevel();
+		hits.resize(rays.size());
+		if (rays.size() <= bvhBatchChunk) {
+			for (size_t i = 0; i < rays.size(); i++)
+				hits[i] = intersectBuilt(rays[i]);
+			return;
+		}
+		if (!queryWorkers)
+			queryWorkers.reset(new WorkerPool(max(1u, thread::hardware_concurrency())));
+		for (size_t first = 0; first < rays.size(); first += bvhBatchChunk) {
+			size_t last = min(rays.size(), first + bvhBatchChunk);
+			queryWorkers->submit([this, &rays, &hits, first, last] {
+				for (size_t i = first; i < last; i++)
+					hits[i] = intersectBuilt(rays[i]);
+			});
+		}
+		queryWorkers->wait();
+	}
+
+private:
+	struct BvhMesh {
+		vector<glm::vec3> positions;
+		vector<int> indices;
+		vector<Bvh4Node> nodes;
+		vector<int> order;
+		int depth = 0;
+		Bounds bounds;
+	};
+
+	struct BvhInstance {
+		int mesh = 0;
+		string name;
+		glm::mat4 toWorld, toObject;
+		Bounds worldBounds;
+	};
+
+	// Set an instance's transforms and world bounds
+	void placeInstance(BvhInstance& inst, const glm::mat4& model)
+	{
+		inst.toWorld = model;
+		inst.toObject = glm::inverse(model);
+
+		// World bounds from the eight transformed corners of the mesh bounds
+		const Bounds& local = meshes[inst.mesh].bounds;
+		inst.worldBounds = Bounds();
+		for (int corner = 0; corner < 8; corner++) {
+			glm::vec3 point((corner & 1) ? local.upper.x : local.lower.x, (corner & 2) ? local.upper.y : local.lower.y, (corner & 4) ? local.upper.z : local.lower.z);
+			inst.worldBounds.grow(glm::vec3(model * glm::vec4(point, 1.0f)));
+		}
+		topLevelDirty = true;
+	}
+
+	void updateTopLevel()
+	{
+		if (!topLevelDirty)
+			return;
+		vector<Bounds> instanceBounds(instances.size());
+		for (size_t i = 0; i < instances.size(); i++)
+			instanceBounds[i] = instances[i].worldBounds;
+		topDepth = buildBvh4(instanceBounds, topNodes, topOrder);
+		topLevelDirty = false;
+	}
+
+	// Query against the current trees; safe to call from several threads at once
+	RayHit intersectBuilt(const Ray& ray) const
+	{
+		RayHit hit;
+		float closest = ray.maxDistance;
+
+		traverseBvh4(topNodes, topDepth, ray.origin, ray.direction, closest, [&](int first, int count) {
+			for (int i = first; i < first + count; i++) {
+				int instanceIndex = topOrder[i];
+				const BvhInstance& inst = instances[instanceIndex];
+				const BvhMesh& mesh = meshes[inst.mesh];
+
+				// Object space ray; the direction keeps its scale so distances stay comparable
+				glm::vec3 origin(inst.toObject * glm::vec4(ray.origin, 1.0f));
+				glm::vec3 direction(inst.toObject * glm::vec4(ray.direction, 0.0f));
+
+				traverseBvh4(mesh.nodes, mesh.depth, origin, direction, closest, [&](int firstTriangle, int triangleCount) {
+					for (int t = firstTriangle; t < firstTriangle + triangleCount; t++) {
+						int triangle = mesh.order[t];
+						float distance, u, v;
+						if (intersectTriangle(origin, direction, mesh.positions[mesh.indices[triangle * 3]], mesh.positions[mesh.indices[triangle * 3 + 1]],
+							mesh.positions[mesh.indices[triangle * 3 + 2]], distance, u, v) && distance < closest) {
+							closest = distance;
+							hit.instance = instanceIndex;
+							hit.triangle = triangle;
+							hit.distance = distance;
+							hit.u = u;
+							hit.v = v;
+						}
+					}
+				});
+			}
+		});
+		return hit;
+	}
+
+	vector<BvhMesh> meshes;
+	vector<BvhInstance> instances;
+	vector<Bvh4Node> topNodes;
+	vector<int> topOrder;
+	int topDepth = 0;
+	bool topLevelDirty = true;
+	unique_ptr<WorkerPool> queryWorkers; // Started by the first large batch; declared last so it is joined first
+};
+
+// What must be drawn again before the window is up to date. With nothing invalidated the render
+// loop sleeps in glfwWaitEventsTimeout instead of redrawing an unchanged scene.
+class FrameInvalidation
 {
-	// Create Shader object
-	GLuint shaderID = glCreateShader(shaderType);
-	const char* src = source.c_str();
+public:
+	void invalidateAll() { everything = true; }
+
+	// Part of the window changed (pixels, origin bottom left); only it is redrawn if nothing else is
+	void invalidateRect(int x0, int y0, int x1, int y1)
+	{
+		if (x1 <= x0 || y1 <= y0)
+			return;
+		if (hasRect) {
+			x0 = min(x0, rectX0);
+			y0 = min(y0, rectY0);
+			x1 = max(x1, rectX1);
+			y1 = max(y1, rectY1);
+		}
+		rectX0 = x0;
+		rectY0 = y0;
+		rectX1 = x1;
+		rectY1 = y1;
+		hasRect = true;
+	}
 
-	// Attach source code to Shader object
-	glShaderSource(shaderID, 1, &src, nullptr);
+	// Show the last frame again without drawing the scene (the window lost its contents)
+	void requestPresent() { present = true; }
 
-	// Compile Shader
-	glCompileShader(shaderID);
+	bool sceneDirty() const { return everything || hasRect; }
+	bool partial() const { return !everything && hasRect; }
+	bool presentRequested() const { return present; }
+	bool pending() const { return sceneDirty() || present; }
 
-	// Return ID of Compiled shader
-	return shaderID;
+	void rect(int& x0, int& y0, int& x1, int& y1) const
+	{
+		x0 = rectX0;
+		y0 = rectY0;
+		x1 = rectX1;
+		y1 = rectY1;
+	}
+
+	void clear() { everything = hasRect = present = false; }
 
+private:
+	bool everything = true, hasRect = false, present = false;
+	int rectX0 = 0, rectY0 = 0, rectX1 = 0, rectY1 = 0;
+};
+FrameInvalidation frameInvalidation;
+
+// World space ray through a window position, unprojected with the current view and projection
+Ray cursorRay(GLFWwindow* window, double xpos, double ypos)
+{
+	int windowWidth, windowHeight;
+	glfwGetWindowSize(window, &windowWidth, &windowHeight);
+	float x = 2.0f * (float)xpos / max(1, windowWidth) - 1.0f;
+	float y = 1.0f - 2.0f * (float)ypos / max(1, windowHeight);
+
+	glm::mat4 inverseViewProjection = glm::inverse(projectionMatrix * viewMatrix);
+	glm::vec4 nearPoint = inverseViewProjection * glm::vec4(x, y, -1.0f, 1.0f);
+	glm::vec4 farPoint = inverseViewProjection * glm::vec4(x, y, 1.0f, 1.0f);
+
+	Ray ray;
+	ray.origin = glm::vec3(nearPoint) / nearPoint.w;
+	ray.direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - ray.origin);
+	return ray;
 }
 
-// Create Program Object
-static GLuint CreateShaderProgram(const string& vertexShader, const string& fragmentShader)
+// Small xorshift generator; each texel and pass gets its own seed so results don't depend on scheduling
+struct BakeRandom {
+	explicit BakeRandom(unsigned seed) : state(seed * 2654435761u | 1u) {}
+	float next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return (state >> 8) * (1.0f / 16777216.0f);
+	}
+	unsigned state;
+};
+
+// Closest point to p on the 2D triangle a, b, c
+static glm::vec2 closestPointOnTriangle(const glm::vec2& p, const glm::vec2& a, const glm::vec2& b, const glm::vec2& c)
 {
-	// Compile vertex shader
-	GLuint vertexShaderComp = CompileShader(vertexShader, GL_VERTEX_SHADER);
+	float side0 = (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+	float side1 = (c.x - b.x) * (p.y - b.y) - (c.y - b.y) * (p.x - b.x);
+	float side2 = (a.x - c.x) * (p.y - c.y) - (a.y - c.y) * (p.x - c.x);
+	if ((side0 >= 0.0f && side1 >= 0.0f && side2 >= 0.0f) || (side0 <= 0.0f && side1 <= 0.0f && side2 <= 0.0f))
+		return p;
+
+	const glm::vec2 edges[3][2] = { { a, b }, { b, c }, { c, a } };
+	glm::vec2 best = a;
+	float bestDistance = FLT_MAX;
+	for (const auto& edge : edges) {
+		glm::vec2 along = edge[1] - edge[0];
+		float t = glm::clamp(glm::dot(p - edge[0], along) / max(glm::dot(along, along), 1e-12f), 0.0f, 1.0f);
+		glm::vec2 point = edge[0] + along * t;
+		float distance = glm::dot(p - point, p - point);
+		if (distance < bestDistance) {
+			bestDistance = distance;
+			best = point;
+		}
+	}
+	return best;
+}
 
-	// Compile fragment shader
-	GLuint fragmentShaderComp = CompileShader(fragmentShader, GL_FRAGMENT_SHADER);
+// Bakes the static lighting on the CPU: lightmaps for static meshes, laid out as one chart per
+// triangle in a second UV set, plus an irradiance probe grid for objects without lightmaps.
+// Passes run tile by tile on every core and each finished pass refines the uploaded result.
+// Finished bakes are saved to a file that later runs load instead of baking again.
+class LightmapBaker
+{
+public:
+	~LightmapBaker() { shutdown(); }
+
+	// Add static geometry with position first in each vertex. Lightmapped meshes must use the
+	// 11 float layout and get a drawable copy carrying lightmap UVs; the others only occlude and
+	// bounce light. Closed meshes face their normals outward, open ones toward the light.
+	template <typename Index>
+	int addStaticMesh(const GLfloat* meshVertices, int stride, const Index* triangles, int indexCount, const glm::vec3& albedo, bool lightmapped, bool closed)
+	{
+		meshes.emplace_back();
+		BakeMesh& mesh = meshes.back();
+		int vertexCount = 0;
+		for (int i = 0; i < indexCount; i++)
+			vertexCount = max(vertexCount, (int)triangles[i] + 1);
+		mesh.vertices.assign(meshVertices, meshVertices + vertexCount * stride);
+		for (int i = 0; i < indexCount - indexCount % 3; i++)
+			mesh.indices.push_back((int)triangles[i]);
+		mesh.stride = stride;
+		mesh.albedo = albedo;
+		mesh.lightmapped = lightmapped;
+		mesh.closed = closed;
+		return (int)meshes.size() - 1;
+	}
 
-	// Create program object
-	GLuint shaderProgram = glCreateProgram();
+	// Start baking with one world transform per added mesh; ignored while a bake is running
+	void start(const vector<glm::mat4>& transforms)
+	{
+		if (passRunning) {
+			cout << "Lightmap bake already running" << endl;
+			return;
+		}
+		if (!workers)
+			workers.reset(new WorkerPool(max(1u, thread::hardware_concurrency())));
 
-	// Attach vertex and fragment shaders to program object
-	glAttachShader(shaderProgram, vertexShaderComp);
-	glAttachShader(shaderProgram, fragmentShaderComp);
+		scene.reset(new SceneBvh);
+		for (size_t i = 0; i < meshes.size(); i++) {
+			int bvhMesh = scene->addMesh(&meshes[i].vertices[0], meshes[i].stride, &meshes[i].indices[0], (int)meshes[i].indices.size());
+			scene->addInstance(bvhMesh, "", transforms[i]);
+		}
+		scene->prepareForQueries();
+		bakeLightPosition = lightPosition;
+		bakeKey = sceneKey(transforms);
+
+		layoutCharts(transforms);
+		accumulated.assign(texels.size(), glm::vec3(0.0f));
+		samplesDone = 0;
+
+		Bounds bounds = scene->sceneBounds();
+		probeLower = bounds.lower;
+		probeSize = glm::max(bounds.upper - bounds.lower, glm::vec3(1e-3f));
+		for (vector<float>& channel : probeCoefficients)
+			channel.assign(probeGridX * probeGridY * probeGridZ * 4, 0.0f);
+
+		cout << "Baking lightmaps: " << atlasWidth << "x" << atlasHeight << " atlas, " << probeGridX * probeGridY * probeGridZ
+			<< " probes, " << bakeSampleBudget << " samples per texel" << endl;
+		bakeStart = glfwGetTime();
+		queuePass();
+	}
 
-	// Link shaders to create executable
-	glLinkProgram(shaderProgram);
+	// Upload a finished pass and queue the next one until the sample budget is spent; true
+	// if the baked lighting changed
+	bool update()
+	{
+		if (!passRunning || jobsRemaining > 0)
+			return false;
+		passRunning = false;
+		if (samplesDone == 0)
+			uploadProbes();
+		samplesDone += bakeSamplesPerPass;
+		uploadLightmap();
+
+		if (samplesDone < bakeSampleBudget)
+			queuePass();
+		else {
+			cout << "Lightmap bake finished in " << glfwGetTime() - bakeStart << " s" << endl;
+			save(bakeFilePath);
+		}
+		return true;
+	}
 
-	// Delete compiled vertex and fragment shaders
-	glDeleteShader(vertexShaderComp);
-	glDeleteShader(fragmentShaderComp);
+	// Load a bake saved by an earlier run; false (keeping per pixel lighting) if the file is
+	// missing, unreadable or was baked from other geometry, transforms or settings
+	bool load(const string& path, const vector<glm::mat4>& transforms)
+	{
+		if (passRunning)
+			return false;
+		ifstream file(path, ios::binary);
+		if (!file)
+			return false;
+
+		char magic[4] = {};
+		unsigned version = 0;
+		unsigned long long key = 0;
+		file.read(magic, 4);
+		file.read((char*)&version, sizeof(version));
+		file.read((char*)&key, sizeof(key));
+		if (!file || memcmp(magic, "BAKE", 4) != 0 || version != bakeFileVersion || key != sceneKey(transforms)) {
+			cout << path << " was baked for a different scene; press F8 to bake again" << endl;
+			return false;
+		}
 
-	// Return Shader Program
-	return shaderProgram;
+		int width = 0, height = 0;
+		file.read((char*)&width, sizeof(width));
+		file.read((char*)&height, sizeof(height));
+		if (!file || width <= 0 || height <= 0 || width > 16384 || height > 16384)
+			return false;
+		vector<glm::vec3> pixels((size_t)width * height);
+		file.read((char*)pixels.data(), pixels.size() * sizeof(glm::vec3));
+
+		vector<vector<GLfloat>> drawVertices(meshes.size());
+		for (vector<GLfloat>& vertices : drawVertices) {
+			int floatCount = 0;
+			file.read((char*)&floatCount, sizeof(floatCount));
+			if (!file || floatCount < 0 || floatCount % 13 != 0)
+				return false;
+			vertices.resize(floatCount);
+			file.read((char*)vertices.data(), floatCount * sizeof(GLfloat));
+		}
 
-}
+		glm::vec3 lower, size;
+		file.read((char*)&lower, sizeof(lower));
+		file.read((char*)&size, sizeof(size));
+		vector<float> coefficients[3];
+		for (vector<float>& channel : coefficients) {
+			channel.resize(probeGridX * probeGridY * probeGridZ * 4);
+			file.read((char*)channel.data(), channel.size() * sizeof(float));
+		}
+		if (!file) {
+			cout << path << " is truncated; press F8 to bake again" << endl;
+			return false;
+		}
+
+		atlasWidth = width;
+		atlasHeight = height;
+		lightmapPixels = move(pixels);
+		for (size_t m = 0; m < meshes.size(); m++)
+			if (meshes[m].lightmapped)
+				createDrawCopy(meshes[m], drawVertices[m]);
+		probeLower = lower;
+		probeSize = size;
+		for (int channel = 0; channel < 3; channel++)
+			probeCoefficients[channel] = move(coefficients[channel]);
+		uploadLightmapTexture();
+		uploadProbes();
+		bakeKey = key;
+		samplesDone = bakeSampleBudget;
+		cout << "Loaded baked lighting from " << path << endl;
+		return true;
+	}
+
+	// True once the first pass has been uploaded
+	bool ready() const { return samplesDone > 0; }
+
+	// Bind the lightmap to unit 1 and the probe grid to units 2-4 and set the probe mapping
+	void bindTextures(GLuint program) const
+	{
+		glState.activeTexture(GL_TEXTURE1);
+		glState.bindTexture(GL_TEXTURE_2D, lightmap);
+		for (int i = 0; i < 3; i++) {
+			glState.activeTexture(GL_TEXTURE2 + i);
+			glState.bindTexture(GL_TEXTURE_3D, probeTextures[i]);
+		}
+		glState.activeTexture(GL_TEXTURE0);
+
+		// Probe i sits at texel center (i + 0.5) / n
+		glm::vec3 cells((float)probeGridX, (float)probeGridY, (float)probeGridZ);
+		glm::vec3 scale = (cells - 1.0f) / (probeSize * cells);
+		glm::vec3 offset = 0.5f / cells - probeLower * scale;
+		glUniform3f(glGetUniformLocation(program, "probeScale"), scale.x, scale.y, scale.z);
+		glUniform3f(glGetUniformLocation(program, "probeOffset"), offset.x, offset.y, offset.z);
+	}
+
+	// Draw the lightmapped copy of a mesh with its own VAO
+	void drawMesh(int mesh) const
+	{
+		glState.bindVertexArray(meshes[mesh].vertexArray);
+		glDrawArrays(GL_TRIANGLES, 0, meshes[mesh].drawCount);
+	}
+
+	// Abandon queued work, join the threads and free the GL objects
+	void shutdown()
+	{
+		cancelled = true;
+		if (workers)
+			workers->stop();
+		passRunning = false;
+		lightmap.release();
+		for (GLHandle& texture : probeTextures)
+			texture.release();
+		for (BakeMesh& mesh : meshes) {
+			mesh.vertexArray.release();
+			mesh.vertexBuffer.release();
+		}
+	}
+
+private:
+	struct BakeMesh {
+		vector<GLfloat> vertices;
+		vector<int> indices;
+		int stride = 3;
+		glm::vec3 albedo;
+		bool lightmapped = false, closed = false;
+		vector<GLfloat> drawVertices; // Drawable copy, kept for saving the bake
+		GLHandle vertexArray, vertexBuffer;
+		int drawCount = 0;
+	};
+
+	static const unsigned bakeFileVersion = 1;
+
+	// Fingerprint of everything a bake depends on, so a saved bake is only reused for the
+	// scene it was made from (FNV-1a over the raw bytes)
+	unsigned long long sceneKey(const vector<glm::mat4>& transforms) const
+	{
+		unsigned long long hash = 14695981039346656037ull;
+		auto add = [&hash](const void* data, size_t bytes) {
+			const unsigned char* p = (const unsigned char*)data;
+			for (size_t i = 0; i < bytes; i++)
+				hash = (hash ^ p[i]) * 1099511628211ull;
+		};
+		for (size_t m = 0; m < meshes.size(); m++) {
+			const BakeMesh& mesh = meshes[m];
+			add(mesh.vertices.data(), mesh.vertices.size() * sizeof(GLfloat));
+			add(mesh.indices.data(), mesh.indices.size() * sizeof(int));
+			add(&mesh.stride, sizeof(mesh.stride));
+			add(&mesh.albedo, sizeof(mesh.albedo));
+			bool flags[2] = { mesh.lightmapped, mesh.closed };
+			add(flags, sizeof(flags));
+			add(&transforms[m], sizeof(glm::mat4));
+		}
+		add(&lightPosition, sizeof(lightPosition));
+		add(&lightColor, sizeof(lightColor));
+		add(&ambientStrength, sizeof(ambientStrength));
+		const float settings[] = { (float)lightmapAtlasWidth, lightmapTexelsPerUnit, (float)lightmapPadding, (float)bakeSampleBudget,
+			(float)bakeMaxBounces, (float)probeGridX, (float)probeGridY, (float)probeGridZ, (float)probeSamples };
+		add(settings, sizeof(settings));
+		return hash;
+	}
+
+	// Write the finished bake: the lightmap, each mesh's drawable copy with its lightmap UVs and
+	// the probe coefficients
+	void save(const string& path) const
+	{
+		ofstream file(path, ios::binary);
+		unsigned version = bakeFileVersion;
+		file.write("BAKE", 4);
+		file.write((const char*)&version, sizeof(version));
+		file.write((const char*)&bakeKey, sizeof(bakeKey));
+		file.write((const char*)&atlasWidth, sizeof(atlasWidth));
+		file.write((const char*)&atlasHeight, sizeof(atlasHeight));
+		file.write((const char*)lightmapPixels.data(), lightmapPixels.size() * sizeof(glm::vec3));
+		for (const BakeMesh& mesh : meshes) {
+			int floatCount = (int)mesh.drawVertices.size();
+			file.write((const char*)&floatCount, sizeof(floatCount));
+			file.write((const char*)mesh.drawVertices.data(), floatCount * sizeof(GLfloat));
+		}
+		file.write((const char*)&probeLower, sizeof(probeLower));
+		file.write((const char*)&probeSize, sizeof(probeSize));
+		for (const vector<float>& channel : probeCoefficients)
+			file.write((const char*)channel.data(), channel.size() * sizeof(float));
+		if (file)
+			cout << "Saved baked lighting to " << path << endl;
+		else
+			cout << "Failed to write " << path << endl;
+	}
+
+	// World space sample point of one lightmap texel
+	struct BakeTexel {
+		glm::vec3 position, normal;
+		bool covered = false;
+	};
+
+	// One triangle's chart: triangle corners in texels relative to the chart's corner
+	struct Chart {
+		int mesh, triangle;
+		glm::vec2 corners[3];
+		int x = 0, y = 0, w = 0, h = 0;
+	};
+
+	// Flatten every lightmapped triangle into its own chart, shelf pack the charts into the
+	// atlas, find the world position behind each covered texel and build the drawable copies
+	void layoutCharts(const vector<glm::mat4>& transforms)
+	{
+		vector<Chart> charts;
+		for (size_t m = 0; m < meshes.size(); m++) {
+			if (!meshes[m].lightmapped)
+				continue;
+			const BakeMesh& mesh = meshes[m];
+			for (size_t t = 0; t < mesh.indices.size() / 3; t++) {
+				glm::vec3 a = worldPosition(m, transforms[m], mesh.indices[t * 3]);
+				glm::vec3 b = worldPosition(m, transforms[m], mesh.indices[t * 3 + 1]);
+				glm::vec3 c = worldPosition(m, transforms[m], mesh.indices[t * 3 + 2]);
+
+				// Triangle in its own plane, first edge along x
+				Chart chart;
+				chart.mesh = (int)m;
+				chart.triangle = (int)t;
+				glm::vec3 xAxis = b - a, faceNormal = glm::cross(b - a, c - a);
+				float edgeLength = glm::length(xAxis);
+				glm::vec2 flat[3] = { glm::vec2(0.0f), glm::vec2(0.0f), glm::vec2(0.0f) };
+				if (edgeLength > 1e-6f && glm::length(faceNormal) > 1e-12f) {
+					xAxis /= edgeLength;
+					glm::vec3 yAxis = glm::normalize(glm::cross(faceNormal, xAxis));
+					flat[1] = glm::vec2(edgeLength, 0.0f);
+					flat[2] = glm::vec2(glm::dot(c - a, xAxis), glm::dot(c - a, yAxis));
+				}
+				glm::vec2 lower = glm::min(flat[0], glm::min(flat[1], flat[2]));
+				glm::vec2 extent = glm::max(flat[0], glm::max(flat[1], flat[2])) - lower;
+				float density = min(lightmapTexelsPerUnit, (lightmapAtlasWidth - 2 * lightmapPadding) / max(1e-6f, max(extent.x, extent.y)));
+				for (int k = 0; k < 3; k++)
+					chart.corners[k] = (flat[k] - lower) * density + (float)lightmapPadding;
+				chart.w = (int)ceil(extent.x * density) + 2 * lightmapPadding;
+				chart.h = (int)ceil(extent.y * density) + 2 * lightmapPadding;
+				charts.push_back(chart);
+			}
+		}
+
+		// Shelf packing, tallest charts first
+		vector<int> packOrder(charts.size());
+		for (size_t i = 0; i < packOrder.size(); i++)
+			packOrder[i] = (int)i;
+		sort(packOrder.begin(), packOrder.end(), [&](int l, int r) { return charts[l].h > charts[r].h; });
+		int shelfX = 0, shelfY = 0, shelfHeight = 0;
+		for (int i : packOrder) {
+			if (shelfX + charts[i].w > lightmapAtlasWidth) {
+				shelfY += shelfHeight;
+				shelfX = shelfHeight = 0;
+			}
+			charts[i].x = shelfX;
+			charts[i].y = shelfY;
+			shelfX += charts[i].w;
+			shelfHeight = max(shelfHeight, charts[i].h);
+		}
+		atlasWidth = lightmapAtlasWidth;
+		atlasHeight = max(4, (shelfY + shelfHeight + 3) / 4 * 4);
+
+		// Texels whose square touches a triangle sample the closest point on it
+		texels.assign((size_t)atlasWidth * atlasHeight, BakeTexel());
+		for (const Chart& chart : charts) {
+			const BakeMesh& mesh = meshes[chart.mesh];
+			glm::vec3 corner[3];
+			for (int k = 0; k < 3; k++)
+				corner[k] = worldPosition(chart.mesh, transforms[chart.mesh], mesh.indices[chart.triangle * 3 + k]);
+			glm::vec3 faceNormal = glm::cross(corner[1] - corner[0], corner[2] - corner[0]);
+			if (glm::length(faceNormal) < 1e-12f)
+				continue;
+			faceNormal = glm::normalize(faceNormal);
+			glm::vec3 faceCenter = (corner[0] + corner[1] + corner[2]) / 3.0f;
+			glm::vec3 facing = mesh.closed ? faceCenter - meshCenter(chart.mesh, transforms[chart.mesh]) : bakeLightPosition - faceCenter;
+			if (glm::dot(faceNormal, facing) < 0.0f)
+				faceNormal = -faceNormal;
+
+			const glm::vec2* p = chart.corners;
+			float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (p[1].y - p[0].y);
+			for (int y = 0; y < chart.h; y++)
+				for (int x = 0; x < chart.w; x++) {
+					glm::vec2 center(x + 0.5f, y + 0.5f);
+					glm::vec2 point = closestPointOnTriangle(center, p[0], p[1], p[2]);
+					if (glm::dot(point - center, point - center) > 0.5f)
+						continue;
+					float w1 = ((point.x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (point.y - p[0].y)) / area;
+					float w2 = ((p[1].x - p[0].x) * (point.y - p[0].y) - (point.x - p[0].x) * (p[1].y - p[0].y)) / area;
+					BakeTexel& texel = texels[(size_t)(chart.y + y) * atlasWidth + chart.x + x];
+					texel.position = corner[0] + (corner[1] - corner[0]) * w1 + (corner[2] - corner[0]) * w2;
+					texel.normal = faceNormal;
+					texel.covered = true;
+				}
+		}
+
+		// Drawable copies: unwelded triangles, the original 11 floats plus the lightmap UV
+		vector<vector<GLfloat>> drawVertices(meshes.size());
+		for (const Chart& chart : charts) {
+			const BakeMesh& mesh = meshes[chart.mesh];
+			for (int k = 0; k < 3; k++) {
+				const GLfloat* source = &mesh.vertices[mesh.indices[chart.triangle * 3 + k] * mesh.stride];
+				drawVertices[chart.mesh].insert(drawVertices[chart.mesh].end(), source, source + 11);
+				drawVertices[chart.mesh].push_back((chart.x + chart.corners[k].x) / atlasWidth);
+				drawVertices[chart.mesh].push_back((chart.y + chart.corners[k].y) / atlasHeight);
+			}
+		}
+		for (size_t m = 0; m < meshes.size(); m++)
+			if (meshes[m].lightmapped)
+				createDrawCopy(meshes[m], drawVertices[m]);
+
+		// Worker jobs cover square tiles that contain at least one covered texel
+		tiles.clear();
+		for (int y = 0; y < atlasHeight; y += bakeTileSize)
+			for (int x = 0; x < atlasWidth; x += bakeTileSize) {
+				bool anyCovered = false;
+				for (int ty = y; ty < min(y + bakeTileSize, atlasHeight) && !anyCovered; ty++)
+					for (int tx = x; tx < min(x + bakeTileSize, atlasWidth) && !anyCovered; tx++)
+						anyCovered = texels[(size_t)ty * atlasWidth + tx].covered;
+				if (anyCovered)
+					tiles.push_back(glm::ivec2(x, y));
+			}
+	}
+
+	// Upload a lightmapped mesh's drawable copy (13 floats per vertex) into its own VAO
+	void createDrawCopy(BakeMesh& mesh, vector<GLfloat>& drawVertices)
+	{
+		mesh.drawVertices = move(drawVertices);
+		mesh.vertexArray = GLHandle(GLObjectType::VertexArray);
+		mesh.vertexBuffer = GLHandle(GLObjectType::Buffer);
+		glState.bindVertexArray(mesh.vertexArray);
+		mesh.vertexBuffer.bufferData(GL_ARRAY_BUFFER, mesh.drawVertices.size() * sizeof(GLfloat), mesh.drawVertices.data(), GL_STATIC_DRAW);
+		const int offsets[] = { 0, 3, 6, 8, 11 }, sizes[] = { 3, 3, 2, 3, 2 };
+		for (int attribute = 0; attribute < 5; attribute++) {
+			glVertexAttribPointer(attribute, sizes[attribute], GL_FLOAT, GL_FALSE, 13 * sizeof(GLfloat), (GLvoid*)(offsets[attribute] * sizeof(GLfloat)));
+			glEnableVertexAttribArray(attribute);
+		}
+		glState.bindVertexArray(0);
+		mesh.drawCount = (int)mesh.drawVertices.size() / 13;
+	}
+
+	glm::vec3 worldPosition(size_t mesh, const glm::mat4& model, int vertex) const
+	{
+		const GLfloat* v = &meshes[mesh].vertices[vertex * meshes[mesh].stride];
+		return glm::vec3(model * glm::vec4(v[0], v[1], v[2], 1.0f));
+	}
+
+	glm::vec3 meshCenter(size_t mesh, const glm::mat4& model) const
+	{
+		glm::vec3 sum(0.0f);
+		int count = (int)meshes[mesh].vertices.size() / meshes[mesh].stride;
+		for (int i = 0; i < count; i++)
+			sum += worldPosition(mesh, model, i);
+		return sum / (float)max(1, count);
+	}
+
+	void queuePass()
+	{
+		int pass = samplesDone / bakeSamplesPerPass;
+		bool withProbes = samplesDone == 0;
+		jobsRemaining = (int)tiles.size() + (withProbes ? probeGridZ : 0);
+		passRunning = true;
+		for (size_t tile = 0; tile < tiles.size(); tile++)
+			workers->submit([this, tile, pass] { bakeTile(tiles[tile], pass); finishJob(); });
+		if (withProbes)
+			for (int z = 0; z < probeGridZ; z++)
+				workers->submit([this, z] { bakeProbeSlice(z); finishJob(); });
+	}
+
+	// The last job of a pass wakes the render loop so it can upload the result
+	void finishJob()
+	{
+		if (--jobsRemaining == 0)
+			glfwPostEmptyEvent();
+	}
+
+	void bakeTile(const glm::ivec2& tile, int pass)
+	{
+		for (int y = tile.y; y < min(tile.y + bakeTileSize, atlasHeight) && !cancelled; y++)
+			for (int x = tile.x; x < min(tile.x + bakeTileSize, atlasWidth); x++) {
+				size_t index = (size_t)y * atlasWidth + x;
+				const BakeTexel& texel = texels[index];
+				if (!texel.covered)
+					continue;
+				BakeRandom random((unsigned)(index * 9781 + pass * 6271 + 1));
+				glm::vec3 sum(0.0f);
+				for (int s = 0; s < bakeSamplesPerPass; s++)
+					sum += incidentLight(texel.position, texel.normal, random, 0);
+				accumulated[index] += sum;
+			}
+	}
+
+	// L1 spherical harmonics of the light arriving at each probe in one z slice of the grid
+	void bakeProbeSlice(int z)
+	{
+		const float shBand0 = 0.282095f, shBand1 = 0.488603f;
+		for (int y = 0; y < probeGridY && !cancelled; y++)
+			for (int x = 0; x < probeGridX; x++) {
+				glm::vec3 cell((float)x / max(1, probeGridX - 1), (float)y / max(1, probeGridY - 1), (float)z / max(1, probeGridZ - 1));
+				glm::vec3 position = probeLower + cell * probeSize;
+				int probe = (z * probeGridY + y) * probeGridX + x;
+				BakeRandom random((unsigned)(probe * 7919 + 104729));
+
+				glm::vec3 coefficients[4] = { glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(0.0f) };
+				for (int s = 0; s < probeSamples; s++) {
+					float cosTheta = 1.0f - 2.0f * random.next(), phi = 2.0f * (float)PI * random.next();
+					float sinTheta = sqrt(max(0.0f, 1.0f - cosTheta * cosTheta));
+					Ray ray;
+					ray.origin = position;
+					ray.direction = glm::vec3(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+					glm::vec3 radiance = tracedLight(ray, random, 1);
+					coefficients[0] += radiance * shBand0;
+					coefficients[1] += radiance * (shBand1 * ray.direction.x);
+					coefficients[2] += radiance * (shBand1 * ray.direction.y);
+					coefficients[3] += radiance * (shBand1 * ray.direction.z);
+				}
+
+				// Convolve with the cosine lobe, divide by pi and fold in the basis constants, so the
+				// shader's dot(coefficients, vec4(1, normal)) gives light in the same units as the lightmap
+				float sampleWeight = 4.0f * (float)PI / probeSamples;
+				const float bandScale[4] = { shBand0, 2.0f / 3.0f * shBand1, 2.0f / 3.0f * shBand1, 2.0f / 3.0f * shBand1 };
+				for (int channel = 0; channel < 3; channel++)
+					for (int k = 0; k < 4; k++)
+						probeCoefficients[channel][probe * 4 + k] = coefficients[k][channel] * sampleWeight * bandScale[k];
+			}
+	}
+
+	// Light arriving at a diffuse surface point, in the shader's (ambient + diffuse) units:
+	// ambient, the point light if nothing blocks it, and light bounced off other surfaces
+	glm::vec3 incidentLight(const glm::vec3& position, const glm::vec3& normal, BakeRandom& random, int bounce) const
+	{
+		glm::vec3 light = ambientStrength * lightColor;
+
+		glm::vec3 toLight = bakeLightPosition - position;
+		float lightDistance = glm::length(toLight);
+		float cosine = glm::dot(normal, toLight) / max(lightDistance, 1e-6f);
+		if (cosine > 0.0f) {
+			Ray shadow;
+			shadow.origin = position + normal * bakeRayOffset;
+			shadow.direction = toLight / lightDistance;
+			shadow.maxDistance = lightDistance - bakeRayOffset;
+			if (scene->intersect(shadow).instance < 0)
+				light += cosine * lightColor;
+		}
+
+		if (bounce < bakeMaxBounces) {
+			// Cosine weighted direction, so the estimate is just the traced light
+			glm::vec3 tangent = glm::normalize(glm::cross(abs(normal.x) > 0.5f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f), normal));
+			glm::vec3 bitangent = glm::cross(normal, tangent);
+			float radius = sqrt(random.next()), phi = 2.0f * (float)PI * random.next();
+			Ray ray;
+			ray.origin = position + normal * bakeRayOffset;
+			ray.direction = tangent * (radius * cos(phi)) + bitangent * (radius * sin(phi)) + normal * sqrt(max(0.0f, 1.0f - radius * radius));
+			light += tracedLight(ray, random, bounce + 1);
+		}
+		return light;
+	}
+
+	// Light leaving the first surface a ray hits (black when it escapes the scene)
+	glm::vec3 tracedLight(const Ray& ray, BakeRandom& random, int bounce) const
+	{
+		RayHit hit = scene->intersect(ray);
+		if (hit.instance < 0)
+			return glm::vec3(0.0f);
+		glm::vec3 normal = glm::normalize(scene->hitNormal(hit));
+		if (glm::dot(normal, ray.direction) > 0.0f)
+			normal = -normal;
+		return meshes[hit.instance].albedo * incidentLight(ray.origin + ray.direction * hit.distance, normal, random, bounce);
+	}
+
+	// Average the samples so far, grow the charts into their padding and upload
+	void uploadLightmap()
+	{
+		vector<glm::vec3>& pixels = lightmapPixels;
+		pixels.assign(texels.size(), glm::vec3(0.0f));
+		vector<unsigned char> filled(texels.size());
+		for (size_t i = 0; i < texels.size(); i++) {
+			pixels[i] = accumulated[i] / (float)samplesDone;
+			filled[i] = texels[i].covered;
+		}
+		for (int step = 0; step < lightmapPadding; step++) {
+			vector<unsigned char> wasFilled = filled;
+			for (int y = 0; y < atlasHeight; y++)
+				for (int x = 0; x < atlasWidth; x++) {
+					size_t index = (size_t)y * atlasWidth + x;
+					if (wasFilled[index])
+						continue;
+					glm::vec3 sum(0.0f);
+					int count = 0;
+					for (int ny = max(0, y - 1); ny <= min(atlasHeight - 1, y + 1); ny++)
+						for (int nx = max(0, x - 1); nx <= min(atlasWidth - 1, x + 1); nx++)
+							if (wasFilled[(size_t)ny * atlasWidth + nx]) {
+								sum += pixels[(size_t)ny * atlasWidth + nx];
+								count++;
+							}
+					if (count > 0) {
+						pixels[index] = sum / (float)count;
+						filled[index] = 1;
+					}
+				}
+		}
+
+		uploadLightmapTexture();
+		cout << "Lightmap bake: " << samplesDone << "/" << bakeSampleBudget << " samples per texel" << endl;
+	}
+
+	void uploadLightmapTexture()
+	{
+		if (lightmap == 0) {
+			lightmap = GLHandle(GLObjectType::Texture);
+			glState.bindTexture(GL_TEXTURE_2D, lightmap);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+		glState.bindTexture(GL_TEXTURE_2D, lightmap);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, atlasWidth, atlasHeight, 0, GL_RGB, GL_FLOAT, lightmapPixels.data());
+		glState.bindTexture(GL_TEXTURE_2D, 0);
+		lightmap.trackBytes((size_t)atlasWidth * atlasHeight * 6);
+	}
+
+	void uploadProbes()
+	{
+		for (int channel = 0; channel < 3; channel++) {
+			if (probeTextures[channel] == 0) {
+				probeTextures[channel] = GLHandle(GLObjectType::Texture);
+				glState.bindTexture(GL_TEXTURE_3D, probeTextures[channel]);
+				glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+			}
+			glState.bindTexture(GL_TEXTURE_3D, probeTextures[channel]);
+			glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, probeGridX, probeGridY, probeGridZ, 0, GL_RGBA, GL_FLOAT, probeCoefficients[channel].data());
+			probeTextures[channel].trackBytes((size_t)probeGridX * probeGridY * probeGridZ * 8);
+		}
+		glState.bindTexture(GL_TEXTURE_3D, 0);
+	}
+
+	vector<BakeMesh> meshes;
+	unique_ptr<SceneBvh> scene;
+	glm::vec3 bakeLightPosition;
+	const float bakeRayOffset = 1e-3f; // Keeps rays from hitting the surface they leave
+
+	vector<BakeTexel> texels;
+	vector<glm::vec3> accumulated; // Sum of all samples per texel, written only by the job owning its tile
+	vector<glm::ivec2> tiles;
+	int atlasWidth = 0, atlasHeight = 0;
+	int samplesDone = 0;
+	double bakeStart = 0.0;
+	unsigned long long bakeKey = 0;
+	vector<glm::vec3> lightmapPixels; // Averaged and padded, as uploaded
+	GLHandle lightmap;
+
+	glm::vec3 probeLower, probeSize;
+	vector<float> probeCoefficients[3]; // RGBA per probe for each color channel
+	GLHandle probeTextures[3];
+
+	atomic<int> jobsRemaining{ 0 };
+	atomic<bool> cancelled{ false };
+	bool passRunning = false;
+	unique_ptr<WorkerPool> workers; // Declared last so it is joined first
+};
 
 int main(void) {
 	width = 640; height = 480;
@@ -138,6 +3145,7 @@ int main(void) {
 	glfwSetCursorPosCallback(window, cursor_position_callback);
 	glfwSetMouseButtonCallback(window, mouse_button_callback);
 	glfwSetScrollCallback(window, scroll_callback);
+	glfwSetWindowRefreshCallback(window, window_refresh_callback);
 
 	//Make window's context current
 	glfwMakeContextCurrent(window);
@@ -260,59 +3268,37 @@ int main(void) {
 	};
 
 	//enable depth buffer
-	glEnable(GL_DEPTH_TEST);
+	glState.enable(GL_DEPTH_TEST);
 
 	// wireFrame Mode
 	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-	GLuint pastaVBO, pastaEBO, pastaVAO, floorVAO, floorEBO, floorVBO, lampVAO, lampEBO, lampVBO, sauce1VAO, sauce2VAO, sauce1VBO, sauce2VBO, sauce1EBO, sauce2EBO, oil1VAO, oil2VAO, oil1VBO, oil2VBO, oil1EBO, oil2EBO, pepper1VAO, pepper2VAO, pepper1VBO, pepper2VBO, pepper1EBO, pepper2EBO;
-
-	glGenBuffers(1, &pastaVBO); // Creates VBO
-	glGenBuffers(1, &pastaEBO); // Creates EBO
-
-	glGenBuffers(1, &floorVBO); // Creates VBO
-	glGenBuffers(1, &floorEBO); // Creates EBO
-
-	glGenBuffers(1, &sauce1VBO); // Creates VBO
-	glGenBuffers(1, &sauce1EBO); // Creates EBO
-
-	glGenBuffers(1, &sauce2VBO); // Creates VBO
-	glGenBuffers(1, &sauce2EBO); // Creates EBO
-
-	glGenBuffers(1, &oil1VBO); // Creates VBO
-	glGenBuffers(1, &oil1EBO); // Creates EBO
-
-	glGenBuffers(1, &oil2VBO); // Creates VBO
-	glGenBuffers(1, &oil2EBO); // Creates EBO
-
-	glGenBuffers(1, &pepper1VBO); // Creates VBO
-	glGenBuffers(1, &pepper1EBO); // Creates EBO
-
-	glGenBuffers(1, &pepper2VBO); // Creates VBO
-	glGenBuffers(1, &pepper2EBO); // Creates EBO
-
-	glGenBuffers(1, &lampVBO); // Creates VBO
-	glGenBuffers(1, &lampEBO); // Creates EBO
-
-	glGenVertexArrays(1, &pastaVAO); //Creates VAO
-	glGenVertexArrays(1, &floorVAO); //Creates VAO
-	glGenVertexArrays(1, &sauce1VAO); //Creates VAO
-	glGenVertexArrays(1, &sauce2VAO); //Creates VAO
-	glGenVertexArrays(1, &oil1VAO); //Creates VAO
-	glGenVertexArrays(1, &oil2VAO); //Creates VAO
-	glGenVertexArrays(1, &pepper1VAO); //Creates VAO
-	glGenVertexArrays(1, &pepper2VAO); //Creates VAO
-	glGenVertexArrays(1, &lampVAO); //Creates VAO
-
-
+	// GL objects are owned by GLHandle so every allocation is tracked and freed at shutdown
+	GLHandle pastaVAO(GLObjectType::VertexArray), pastaVBO(GLObjectType::Buffer), pastaEBO(GLObjectType::Buffer);
+	GLHandle floorVAO(GLObjectType::VertexArray), floorVBO(GLObjectType::Buffer), floorEBO(GLObjectType::Buffer);
+	GLHandle sauce1VAO(GLObjectType::VertexArray), sauce1VBO(GLObjectType::Buffer), sauce1EBO(GLObjectType::Buffer);
+	GLHandle sauce2VAO(GLObjectType::VertexArray), sauce2VBO(GLObjectType::Buffer), sauce2EBO(GLObjectType::Buffer);
+	GLHandle oil1VAO(GLObjectType::VertexArray), oil1VBO(GLObjectType::Buffer), oil1EBO(GLObjectType::Buffer);
+	GLHandle oil2VAO(GLObjectType::VertexArray), oil2VBO(GLObjectType::Buffer), oil2EBO(GLObjectType::Buffer);
+	GLHandle pepper1VAO(GLObjectType::VertexArray), pepper1VBO(GLObjectType::Buffer), pepper1EBO(GLObjectType::Buffer);
+	GLHandle pepper2VAO(GLObjectType::VertexArray), pepper2VBO(GLObjectType::Buffer), pepper2EBO(GLObjectType::Buffer);
+	GLHandle lampVAO(GLObjectType::VertexArray), lampVBO(GLObjectType::Buffer), lampEBO(GLObjectType::Buffer);
+
+	GLHandle* sceneObjects[] = {
+		&pastaVAO, &pastaVBO, &pastaEBO, &floorVAO, &floorVBO, &floorEBO,
+		&sauce1VAO, &sauce1VBO, &sauce1EBO, &sauce2VAO, &sauce2VBO, &sauce2EBO,
+		&oil1VAO, &oil1VBO, &oil1EBO, &oil2VAO, &oil2VBO, &oil2EBO,
+		&pepper1VAO, &pepper1VBO, &pepper1EBO, &pepper2VAO, &pepper2VBO, &pepper2EBO,
+		&lampVAO, &lampVBO, &lampEBO
+	};
 
-	glBindVertexArray(pastaVAO);
+	glState.bindVertexArray(pastaVAO);
 
 		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, pastaVBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pastaEBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
+		glState.bindBuffer(GL_ARRAY_BUFFER, pastaVBO); // Select VBO
+		glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, pastaEBO); // Select EBO
+		pastaVBO.bufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
+		pastaEBO.bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
 		// Specify attribute location and layout to GPU
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
 		glEnableVertexAttribArray(0);
@@ -323,19 +3309,19 @@ int main(void) {
 		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(8 * sizeof(GLfloat)));
 		glEnableVertexAttribArray(3);
 
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
+	glState.bindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
 
 
 
 
 	//Floor
-	glBindVertexArray(floorVAO);
+	glState.bindVertexArray(floorVAO);
 
 		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, floorVBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, floorEBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(floorVertices), floorVertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(floorIndices), floorIndices, GL_STATIC_DRAW); // Load indices 
+		glState.bindBuffer(GL_ARRAY_BUFFER, floorVBO); // Select VBO
+		glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, floorEBO); // Select EBO
+		floorVBO.bufferData(GL_ARRAY_BUFFER, sizeof(floorVertices), floorVertices, GL_STATIC_DRAW); // Load vertex attributes
+		floorEBO.bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(floorIndices), floorIndices, GL_STATIC_DRAW); // Load indices 
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
@@ -345,189 +3331,216 @@ int main(void) {
 		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(8 * sizeof(GLfloat)));
 		glEnableVertexAttribArray(3);
 
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
+	glState.bindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
 
 
 
 
 	//Sauce body
-	glBindVertexArray(sauce1VAO);
+	glState.bindVertexArray(sauce1VAO);
 
 		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, sauce1VBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sauce1EBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
+		glState.bindBuffer(GL_ARRAY_BUFFER, sauce1VBO); // Select VBO
+		glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, sauce1EBO); // Select EBO
+		sauce1VBO.bufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
+		sauce1EBO.bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
 		glEnableVertexAttribArray(1);
 
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
+	glState.bindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
 
 
 
 	//Sauce lid
-	glBindVertexArray(sauce2VAO);
+	glState.bindVertexArray(sauce2VAO);
 
 		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, sauce2VBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sauce2EBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
+		glState.bindBuffer(GL_ARRAY_BUFFER, sauce2VBO); // Select VBO
+		glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, sauce2EBO); // Select EBO
+		sauce2VBO.bufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
+		sauce2EBO.bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
 		glEnableVertexAttribArray(1);
 
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
+	glState.bindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
 
 
 
 	//Oil body
-	glBindVertexArray(oil1VAO);
+	glState.bindVertexArray(oil1VAO);
 
 		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, oil1VBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, oil1EBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
+		glState.bindBuffer(GL_ARRAY_BUFFER, oil1VBO); // Select VBO
+		glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, oil1EBO); // Select EBO
+		oil1VBO.bufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
+		oil1EBO.bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
 		glEnableVertexAttribArray(1);
 
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
+	glState.bindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
 
 
 
 	//Oil cap
-	glBindVertexArray(oil2VAO);
+	glState.bindVertexArray(oil2VAO);
 
 		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, oil2VBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, oil1EBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
+		glState.bindBuffer(GL_ARRAY_BUFFER, oil2VBO); // Select VBO
+		glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, oil1EBO); // Select EBO
+		oil2VBO.bufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
+		oil1EBO.bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
 		glEnableVertexAttribArray(1);
 
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
+	glState.bindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
 
 
 
 	//Pepper body
-	glBindVertexArray(pepper1VAO);
+	glState.bindVertexArray(pepper1VAO);
 
 		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, pepper1VBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, oil1EBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
+		glState.bindBuffer(GL_ARRAY_BUFFER, pepper1VBO); // Select VBO
+		glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, oil1EBO); // Select EBO
+		pepper1VBO.bufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
+		oil1EBO.bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
 		glEnableVertexAttribArray(1);
 
 
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
+	glState.bindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
 
 
 
 	//Pepper cap
-	glBindVertexArray(pepper2VAO);
+	glState.bindVertexArray(pepper2VAO);
 
 		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, oil1VBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, oil1EBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
+		glState.bindBuffer(GL_ARRAY_BUFFER, oil1VBO); // Select VBO
+		glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, oil1EBO); // Select EBO
+		oil1VBO.bufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Load vertex attributes
+		oil1EBO.bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
 		glEnableVertexAttribArray(1);
 
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
+	glState.bindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
 
 
 
-	glBindVertexArray(lampVAO);
+	glState.bindVertexArray(lampVAO);
 
 		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, lampVBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lampEBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(lampVertices), lampVertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
+		glState.bindBuffer(GL_ARRAY_BUFFER, lampVBO); // Select VBO
+		glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, lampEBO); // Select EBO
+		lampVBO.bufferData(GL_ARRAY_BUFFER, sizeof(lampVertices), lampVertices, GL_STATIC_DRAW); // Load vertex attributes
+		lampEBO.bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0 * sizeof(GLfloat), (GLvoid*)0);
 		glEnableVertexAttribArray(0);
 
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
-
-
-	//load textures
-	int counterTexWidth, counterTexHeight;
-	int pastaTexWidth, pastaTexHeight;
-	unsigned char* counterImage = SOIL_load_image("counter.png", &counterTexWidth, &counterTexHeight, 0, SOIL_LOAD_RGB);
-	unsigned char* pastaImage = SOIL_load_image("pasta.png", &pastaTexWidth, &pastaTexHeight, 0, SOIL_LOAD_RGB);
-
-	//Generate Counter textures
-	GLuint counterTexture;
-	glGenTextures(1, &counterTexture);
-	glBindTexture(GL_TEXTURE_2D, counterTexture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, counterTexWidth, counterTexHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, counterImage);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	SOIL_free_image_data(counterImage);
-	glBindTexture(GL_TEXTURE_2D, 0);
-
-	//Generate pasta texture
-	GLuint pastaTexture;
-	glGenTextures(1, &pastaTexture);
-	glBindTexture(GL_TEXTURE_2D, pastaTexture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, pastaTexWidth, pastaTexHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, pastaImage);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	SOIL_free_image_data(pastaImage);
-	glBindTexture(GL_TEXTURE_2D, 0);
-
-	// Vertex shader source code
+	glState.bindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
+
+
+	//load textures (coarse mips now, finer ones streamed in as the camera needs them)
+	TextureStreamer streamer;
+	textureStreamer = &streamer;
+	int counterTexture = streamer.load("counter.png");
+	int pastaTexture = streamer.load("pasta.png");
+
+	// Vertex shader source code (specialized by the ShaderFeature defines ShaderCache inserts)
 	string vertexShaderSource =
 		"#version 330 core\n"
-		"layout(location = 0) in vec3 vPosition;"
+		"layout(location = 0) in vec3 vPosition;\n"
+		"#ifdef VERTEX_COLOR\n"
 		"layout(location = 1) in vec3 aColor;"
-		"layout(location = 2) in vec2 texCoord; "
+		"out vec3 oColor;\n"
+		"#endif\n"
+		"#ifdef TEXTURED\n"
+		"layout(location = 2) in vec2 texCoord;"
+		"out vec2 oTexCoord;\n"
+		"#endif\n"
+		"#ifdef LIT\n"
 		"layout(location = 3) in vec3 normal;"
-		"out vec3 oColor;"
-		"out vec2 oTexCoord;"
 		"out vec3 oNormal;"
-		"out vec3 fragPos;"
-		"uniform mat4 model;"
+		"out vec3 fragPos;\n"
+		"#endif\n"
+		"#ifdef LIGHTMAPPED\n"
+		"layout(location = 4) in vec2 lightmapCoord;"
+		"out vec2 oLightmapCoord;\n"
+		"#endif\n"
+		"#ifdef INSTANCED\n"
+		"layout(location = 5) in mat4 model;\n"
+		"#else\n"
+		"uniform mat4 model;\n"
+		"#endif\n"
 		"uniform mat4 view;"
 		"uniform mat4 projection;"
 		"void main()\n"
 		"{\n"
-		"gl_Position = projection * view * model * vec4(vPosition.x, vPosition.y, vPosition.z, 1.0);"
-		"oColor = aColor;"
-		"oTexCoord = texCoord;"
+		"gl_Position = projection * view * model * vec4(vPosition.x, vPosition.y, vPosition.z, 1.0);\n"
+		"#ifdef VERTEX_COLOR\n"
+		"oColor = aColor;\n"
+		"#endif\n"
+		"#ifdef TEXTURED\n"
+		"oTexCoord = texCoord;\n"
+		"#endif\n"
+		"#ifdef LIT\n"
 		"oNormal = mat3(transpose(inverse(model))) * normal;"
-		"fragPos = vec3(model * vec4(vPosition, 1.0f));"
+		"fragPos = vec3(model * vec4(vPosition, 1.0f));\n"
+		"#endif\n"
+		"#ifdef LIGHTMAPPED\n"
+		"oLightmapCoord = lightmapCoord;\n"
+		"#endif\n"
 		"}\n";
 
 	// Fragment shader source code
 	string fragmentShaderSource =
 		"#version 330 core\n"
-		"in vec3 oColor;"
+		"out vec4 fragColor;"
+		"uniform vec3 objectColor;\n"
+		"#ifdef VERTEX_COLOR\n"
+		"in vec3 oColor;\n"
+		"#endif\n"
+		"#ifdef TEXTURED\n"
 		"in vec2 oTexCoord;"
+		"uniform sampler2D myTexture;\n"
+		"#endif\n"
+		"#ifdef LIT\n"
 		"in vec3 oNormal;"
 		"in vec3 fragPos;"
-		"out vec4 fragColor;"
-		"uniform sampler2D myTexture;"
-		"uniform vec3 objectColor;"
 		"uniform vec3 lightColor;"
 		"uniform vec3 lightPos;"
-		"uniform vec3 viewPos;"
+		"uniform vec3 viewPos;\n"
+		"#endif\n"
+		"#ifdef LIGHTMAPPED\n"
+		"in vec2 oLightmapCoord;"
+		"uniform sampler2D lightmap;\n"
+		"#endif\n"
+		"#ifdef PROBES\n"
+		"uniform sampler3D probeRed;"
+		"uniform sampler3D probeGreen;"
+		"uniform sampler3D probeBlue;"
+		"uniform vec3 probeScale;"
+		"uniform vec3 probeOffset;\n"
+		"#endif\n"
 		"void main()\n"
 		"{\n"
+		"vec3 result = objectColor;\n"
+		"#ifdef LIGHTMAPPED\n"
+		"result *= texture(lightmap, oLightmapCoord).rgb;\n"
+		"#endif\n"
+		"#ifdef LIT\n"
 		"//ambient\n"
 		"float ambientStrength = 0.8f;"
 		"vec3 ambient = ambientStrength * lightColor;"
@@ -536,64 +3549,129 @@ int main(void) {
 		"vec3 lightDir = normalize(lightPos - fragPos);"
 		"float diff = max(dot(norm, lightDir), 0.0);"
 		"vec3 diffuse = diff * lightColor;"
+		"vec3 light = ambient + diffuse;\n"
+		"#ifdef SPECULAR\n"
 		"//Specularity\n"
 		"float specularStrength = 1.5f;"
 		"vec3 viewDir = normalize(viewPos - fragPos);"
 		"vec3 reflectDir = reflect(-lightDir, norm);"
 		"float spec = pow(max(dot(viewDir, reflectDir), 0.0), 128);"
-		"vec3 specular = specularStrength * spec * lightColor;"
-		"vec3 result = (ambient + diffuse + specular) * objectColor;"
-		"fragColor = texture(myTexture, oTexCoord) * vec4(result, 1.0f);"
+		"light += specularStrength * spec * lightColor;\n"
+		"#endif\n"
+		"#ifdef PROBES\n"
+		"//Bounce light from the probe grid\n"
+		"vec3 probeCoord = fragPos * probeScale + probeOffset;"
+		"vec4 sh = vec4(1.0f, norm);"
+		"vec3 bounced = vec3(dot(texture(probeRed, probeCoord), sh), dot(texture(probeGreen, probeCoord), sh), dot(texture(probeBlue, probeCoord), sh));"
+		"light += max(bounced, 0.0f);\n"
+		"#endif\n"
+		"result *= light;\n"
+		"#endif\n"
+		"#ifdef VERTEX_COLOR\n"
+		"result *= oColor;\n"
+		"#endif\n"
+		"fragColor = vec4(result, 1.0f);\n"
+		"#ifdef TEXTURED\n"
+		"fragColor *= texture(myTexture, oTexCoord);\n"
+		"#endif\n"
 		"}\n";
 
-
-	// lamp Vertex shader source code
-	string lampVertexShaderSource =
+	// Upscale Vertex shader source code (full screen triangle, no vertex buffer needed)
+	string upscaleVertexShaderSource =
 		"#version 330 core\n"
-		"layout(location = 0) in vec3 vPosition;"
-		"uniform mat4 model;"
-		"uniform mat4 view;"
-		"uniform mat4 projection;"
+		"out vec2 uv;"
+		"uniform vec2 uvScale;"
 		"void main()\n"
 		"{\n"
-		"gl_Position = projection * view * model * vec4(vPosition.x, vPosition.y, vPosition.z, 1.0);"
+		"vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);"
+		"uv = corner * uvScale;"
+		"gl_Position = vec4(corner * 2.0f - 1.0f, 0.0f, 1.0f);"
 		"}\n";
 
-	// lamp Fragment shader source code
-	string lampFragmentShaderSource =
+	// Upscale Fragment shader source code (bilinear, plus optional sharpening)
+	string upscaleFragmentShaderSource =
 		"#version 330 core\n"
+		"in vec2 uv;"
 		"out vec4 fragColor;"
+		"uniform sampler2D sceneColor;"
+		"uniform vec2 uvScale;"
+		"uniform vec2 texelSize;"
+		"uniform float sharpness;"
+		"vec3 scene(vec2 p)\n"
+		"{\n"
+		"return texture(sceneColor, clamp(p, texelSize * 0.5f, uvScale - texelSize * 0.5f)).rgb;"
+		"}\n"
 		"void main()\n"
 		"{\n"
-		"fragColor = vec4(1.0f);"
+		"vec3 color = scene(uv);"
+		"if (sharpness > 0.0f) {"
+		"vec3 neighbors = scene(uv + vec2(texelSize.x, 0.0f)) + scene(uv - vec2(texelSize.x, 0.0f))"
+		" + scene(uv + vec2(0.0f, texelSize.y)) + scene(uv - vec2(0.0f, texelSize.y));"
+		"color = clamp(color + sharpness * (color - neighbors * 0.25f), 0.0f, 1.0f);"
+		"}"
+		"fragColor = vec4(color, 1.0f);"
 		"}\n";
 
 	// Creating Shader Program
-	GLuint shaderProgram = CreateShaderProgram(vertexShaderSource, fragmentShaderSource);
-	GLuint lampShaderProgram = CreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource); 
-
-	/* Loop until the user closes the window */
-	while (!glfwWindowShouldClose(window)) {
-		
-		//set Frame time
-		GLfloat currentFrame = glfwGetTime();
-		deltaTime = currentFrame - lastFrame;
-		lastFrame = currentFrame;
+	ShaderCache sceneShaders(vertexShaderSource, fragmentShaderSource);
+	GLHandle upscaleShaderProgram = CreateShaderProgram(upscaleVertexShaderSource, upscaleFragmentShaderSource);
+
+	// Pick each object's variant once from the attributes its VAO enables and what its material uses
+	const unsigned phongAttributes = 0xF, lightmapAttributes = 0x1F, lampAttributes = 0x1; // Bit n = location n
+	const unsigned phongMaterial = ShaderTextured | ShaderLit | ShaderSpecular;
+	GLuint phongShaderProgram = sceneShaders.program(shaderVariant(phongAttributes, phongMaterial));
+	GLuint bakedShaderProgram = sceneShaders.program(shaderVariant(lightmapAttributes, phongMaterial | ShaderLightmapped));
+	GLuint probeShaderProgram = sceneShaders.program(shaderVariant(phongAttributes, phongMaterial | ShaderProbes));
+	GLuint lampShaderProgram = sceneShaders.program(shaderVariant(lampAttributes, 0)); // Flat white
+
+	// Offscreen scene target, GPU timer and the empty VAO the upscale pass draws with
+	RenderTarget sceneTarget;
+	GpuFrameTimer frameTimer;
+	frameTimer.create();
+	GLHandle screenVAO(GLObjectType::VertexArray);
+
+	FrameCapture capture;
+
+	// Pickable meshes (bottom level trees are built once here) and their instances
+	SceneBvh sceneBvh;
+	int pastaMesh = sceneBvh.addMesh(vertices, 11, indices, sizeof(indices));
+	int floorMesh = sceneBvh.addMesh(floorVertices, 11, floorIndices, 6);
+	int lampMesh = sceneBvh.addMesh(lampVertices, 3, indices, sizeof(indices));
+	int pastaInstance = sceneBvh.addInstance(pastaMesh, "pasta box");
+	int floorInstance = sceneBvh.addInstance(floorMesh, "counter");
+	int lampInstance = sceneBvh.addInstance(lampMesh, "lamp");
+
+	// Static geometry for the lightmap baker. The convex pasta box gets nothing from a lightmap
+	// that its direct lighting and the probe grid miss, so like the lamp it only casts shadows
+	// and bounces light.
+	LightmapBaker lightmapBaker;
+	lightmapBaker.addStaticMesh(vertices, 11, indices, sizeof(indices), objectColor, false, true);
+	int floorBake = lightmapBaker.addStaticMesh(floorVertices, 11, floorIndices, 6, objectColor, true, false);
+	lightmapBaker.addStaticMesh(lampVertices, 3, indices, sizeof(indices), glm::vec3(1.0f), false, true);
+	auto bakeTransforms = [&] {
+		return vector<glm::mat4>{ sceneBvh.instanceTransform(pastaInstance), sceneBvh.instanceTransform(floorInstance), sceneBvh.instanceTransform(lampInstance) };
+	};
 
-		//Resize window
-		glfwGetFramebufferSize(window, &width, &height);
-		glViewport(0, 0, width, height);
+	// Object picked with the left mouse button, drawn tinted on screen but not in posters or recordings
+	int selectedInstance = -1;
+	bool showSelection = true;
 
-		/* Render here */
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	// Draw every object with the given projection into the bound framebuffer
+	auto drawScene = [&](const glm::mat4& projectionMatrix) {
+		// Object color uniform, tinted for the picked object
+		auto setObjectColor = [&](GLuint program, int instance, const glm::vec3& color) {
+			glm::vec3 shown = showSelection && instance == selectedInstance ? glm::mix(color, selectionColor, 0.5f) : color;
+			glUniform3f(glGetUniformLocation(program, "objectColor"), shown.x, shown.y, shown.z);
+		};
 
-		// Use Shader Program exe and select VAO before drawing 
-		glUseProgram(shaderProgram); // Call Shader per-frame when updating attributes
+		// Once a bake has finished a pass the floor reads its lighting from the lightmap and the
+		// pasta box adds bounce light from the probe grid
+		bool baked = useBakedLighting && lightmapBaker.ready();
+		GLuint pastaProgram = baked ? probeShaderProgram : phongShaderProgram;
+		GLuint floorProgram = baked ? bakedShaderProgram : phongShaderProgram;
 
 		// Declare transformations (can be initialized outside loop)		
-		glm::mat4 projectionMatrix;
 		glm::mat4 modelMatrix;
-		glm::mat4 viewMatrix;
 		
 		// Define LookAt Matrix
 
@@ -601,35 +3679,40 @@ int main(void) {
 		viewMatrix = glm::translate(viewMatrix, glm::vec3(1.0f, 0.0f, -5.0f));
 		viewMatrix = glm::rotate(viewMatrix, 145.0f * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
 
-		projectionMatrix = glm::perspective(fov, (GLfloat)width / (GLfloat)height, 0.1f, 100.0f);		//(Field Of View, Width and height in floating point values, near plane, Far plane)
+		// Use a scene program and set the uniforms every object shares; returns the model location
+		auto useSceneProgram = [&](GLuint shaderProgram) -> GLint {
+			glState.useProgram(shaderProgram);
+
+			// Get matrix's uniform location and set matrix
+			GLint viewLoc = glGetUniformLocation(shaderProgram, "view");
+			GLint projLoc = glGetUniformLocation(shaderProgram, "projection");
 
-		// Get matrix's uniform location and set matrix
-		GLint modelLoc = glGetUniformLocation(shaderProgram, "model");
-		GLint viewLoc = glGetUniformLocation(shaderProgram, "view");
-		GLint projLoc = glGetUniformLocation(shaderProgram, "projection");
+			//get light color and light position location
+			GLint lightColorLoc = glGetUniformLocation(shaderProgram, "lightColor");
+			GLint lightPosLoc = glGetUniformLocation(shaderProgram, "lightPos");
+			GLint viewPosLoc = glGetUniformLocation(shaderProgram, "viewPos");
 
-		//get light and object color, and light position location
-		GLint objectColorLoc = glGetUniformLocation(shaderProgram, "objectColor");
-		GLint lightColorLoc = glGetUniformLocation(shaderProgram, "lightColor");
-		GLint lightPosLoc = glGetUniformLocation(shaderProgram, "lightPos");
-		GLint viewPosLoc = glGetUniformLocation(shaderProgram, "viewPos");
+			//Assign Light Color
+			glUniform3f(lightColorLoc, lightColor.x, lightColor.y, lightColor.z);
 
-		//Assign Light and object Colors
-		glUniform3f(objectColorLoc, 0.392f, 0.4901f, 0.0f);
-		glUniform3f(lightColorLoc, 0.15, 1.0, 0.0);
+			if (baked)
+				lightmapBaker.bindTextures(shaderProgram);
 
-		//set light position
-		glUniform3f(lightPosLoc, lightPosition.x, lightPosition.y, lightPosition.z);
+			//set light position
+			glUniform3f(lightPosLoc, lightPosition.x, lightPosition.y, lightPosition.z);
 
-		//Specify view Position
-		glUniform3f(viewPosLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+			//Specify view Position
+			glUniform3f(viewPosLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
 
-		// Pass transformation to shader
-		glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(viewMatrix));
-		glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
+			// Pass transformation to shader
+			glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(viewMatrix));
+			glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
+			return glGetUniformLocation(shaderProgram, "model");
+		};
 
-		glBindTexture(GL_TEXTURE_2D, pastaTexture);
-		glBindVertexArray(pastaVAO); // User-defined VAO must be called before draw. 
+		GLint modelLoc = useSceneProgram(pastaProgram);
+		glState.bindTexture(GL_TEXTURE_2D, streamer.textureId(pastaTexture));
+		glState.bindVertexArray(pastaVAO); // User-defined VAO must be called before draw. 
 
 		for (GLuint i = 0; i < 1; i++)
 		{
@@ -640,33 +3723,43 @@ int main(void) {
 			modelMatrix = glm::rotate(modelMatrix, planeRotations[i] * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
 			modelMatrix = glm::rotate(modelMatrix, 170.f * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
 			glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-			
+			sceneBvh.setTransform(pastaInstance, modelMatrix);
+			setObjectColor(pastaProgram, pastaInstance, objectColor);
+			streamer.requestForMesh(pastaTexture, vertices, indices, sizeof(indices), projectionMatrix * viewMatrix * modelMatrix);
 
 			// Draw primitive(s)
 			draw();
 		}
 
 		// Unbind Shader exe and VOA after drawing per frame
-		glBindVertexArray(0); //Incase different VAO will be used after
+		glState.bindVertexArray(0); //Incase different VAO will be used after
 
-		glBindTexture(GL_TEXTURE_2D, counterTexture);
-		glBindVertexArray(floorVAO); // User-defined VAO must be called before draw. 
+		if (floorProgram != pastaProgram)
+			modelLoc = useSceneProgram(floorProgram);
+		glState.bindTexture(GL_TEXTURE_2D, streamer.textureId(counterTexture));
+		glState.bindVertexArray(floorVAO); // User-defined VAO must be called before draw. 
 		for (GLuint i = 0; i < 1; i++) {
 			glm::mat4 modelMatrix;
 			modelMatrix = glm::translate(modelMatrix, glm::vec3(0.0, -0.5, 0.0));
 			modelMatrix = glm::scale(modelMatrix, glm::vec3(1.f, 1.f, 1.f));
 			glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
+			sceneBvh.setTransform(floorInstance, modelMatrix);
+			setObjectColor(floorProgram, floorInstance, objectColor);
+			streamer.requestForMesh(counterTexture, floorVertices, floorIndices, 6, projectionMatrix * viewMatrix * modelMatrix);
 
-			draw();
+			if (baked)
+				lightmapBaker.drawMesh(floorBake);
+			else
+				draw();
 		}
 
 
 
-		glBindVertexArray(0); //Incase different VAO wii be used after
+		glState.bindVertexArray(0); //Incase different VAO wii be used after
 
-		glUseProgram(0); // Incase different shader will be used after
+		glState.useProgram(0); // Incase different shader will be used after
 
-		glUseProgram(lampShaderProgram);
+		glState.useProgram(lampShaderProgram);
 
 			GLint lampModelLoc = glGetUniformLocation(lampShaderProgram, "model");
 			GLint lampViewLoc = glGetUniformLocation(lampShaderProgram, "view");
@@ -676,26 +3769,248 @@ int main(void) {
 			glUniformMatrix4fv(lampViewLoc, 1, GL_FALSE, glm::value_ptr(viewMatrix));
 			glUniformMatrix4fv(lampProjLoc, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
 
-			glBindVertexArray(lampVAO); // User-defined VAO must be called before draw. 
+			glState.bindVertexArray(lampVAO); // User-defined VAO must be called before draw. 
 			for (GLuint i = 0; i < 1; i++) {
 				glm::mat4 modelMatrix;
 				modelMatrix = glm::translate(modelMatrix, planePositions[i] / glm::vec3(8., 8., 8.) + (lightPosition + glm::vec3(-2.0,1.2,-4.5)));
 				modelMatrix = glm::scale(modelMatrix, glm::vec3(0.125f, 0.125f, 0.125f));
 				modelMatrix = glm::rotate(modelMatrix, 215.0f * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
 				glUniformMatrix4fv(lampModelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
+				sceneBvh.setTransform(lampInstance, modelMatrix);
+				setObjectColor(lampShaderProgram, lampInstance, glm::vec3(1.0f));
 
 				draw();
 			}
 
 
 
-			glBindVertexArray(0); //Incase different VAO wii be used after
+			glState.bindVertexArray(0); //Incase different VAO wii be used after
+	};
 
-		/* Swap front and back buffers */ 
-		glfwSwapBuffers(window);
+	// Invalidate the window area an instance covers on screen (all of it if it reaches behind the camera)
+	auto invalidateInstance = [&](int instance) {
+		if (instance < 0)
+			return;
+		const Bounds& bounds = sceneBvh.instanceBounds(instance);
+		glm::mat4 viewProjection = projectionMatrix * viewMatrix;
+		float x0 = FLT_MAX, y0 = FLT_MAX, x1 = -FLT_MAX, y1 = -FLT_MAX;
+		for (int corner = 0; corner < 8; corner++) {
+			glm::vec4 clip = viewProjection * glm::vec4((corner & 1) ? bounds.upper.x : bounds.lower.x, (corner & 2) ? bounds.upper.y : bounds.lower.y, (corner & 4) ? bounds.upper.z : bounds.lower.z, 1.0f);
+			if (clip.w <= projectionNear) {
+				frameInvalidation.invalidateAll();
+				return;
+			}
+			float x = (clip.x / clip.w * 0.5f + 0.5f) * width, y = (clip.y / clip.w * 0.5f + 0.5f) * height;
+			x0 = min(x0, x);
+			y0 = min(y0, y);
+			x1 = max(x1, x);
+			y1 = max(y1, y);
+		}
+		frameInvalidation.invalidateRect((int)floor(glm::clamp(x0, 0.0f, (float)width)), (int)floor(glm::clamp(y0, 0.0f, (float)height)),
+			(int)ceil(glm::clamp(x1, 0.0f, (float)width)), (int)ceil(glm::clamp(y1, 0.0f, (float)height)));
+	};
 
-		/* Poll for and process events */
-		glfwPollEvents();
+	// Camera values the picture on screen was drawn with
+	GLfloat drawnCamera[10] = {};
+
+	// Set while a recording holds every texture at full resolution
+	bool recordingPinned = false;
+
+	// The saved bake is looked for once drawScene has placed the objects
+	bool frameDrawn = false, bakeLoadPending = true;
+
+	/* Loop until the user closes the window */
+	while (!glfwWindowShouldClose(window)) {
+		
+		//set Frame time
+		GLfloat currentFrame = glfwGetTime();
+		deltaTime = currentFrame - lastFrame;
+		lastFrame = currentFrame;
+
+		//Resize window
+		glfwGetFramebufferSize(window, &width, &height);
+		if (max(1, width) != sceneTarget.allocWidth || max(1, height) != sceneTarget.allocHeight)
+			frameInvalidation.invalidateAll();
+		sceneTarget.resize(width, height);
+
+		// Camera movement, finished texture levels, bake passes and recording all need a new frame
+		GLfloat camera[] = { cameraPosition.x, cameraPosition.y, cameraPosition.z, target.x, target.y, target.z, worldUp.x, worldUp.y, worldUp.z, fov };
+		if (memcmp(camera, drawnCamera, sizeof(camera)) != 0) {
+			memcpy(drawnCamera, camera, sizeof(camera));
+			frameInvalidation.invalidateAll();
+		}
+		if (streamer.uploadFinished())
+			frameInvalidation.invalidateAll();
+
+		// Bake static lighting with the objects where they were drawn, or load a bake saved by an
+		// earlier run once the first frame has placed them
+		if (bakeLoadPending && frameDrawn) {
+			if (lightmapBaker.load(bakeFilePath, bakeTransforms()))
+				frameInvalidation.invalidateAll();
+			bakeLoadPending = false;
+		}
+		if (bakeRequested) {
+			lightmapBaker.start(bakeTransforms());
+			bakeRequested = false;
+		}
+		if (lightmapBaker.update())
+			frameInvalidation.invalidateAll();
+
+		if (captureToggleRequested) {
+			if (capture.active())
+				capture.stop();
+			else
+				capture.start(width, height, captureFormat);
+			captureToggleRequested = false;
+		}
+		if (capture.active())
+			frameInvalidation.invalidateAll();
+		showSelection = !capture.active();
+
+		// Recordings must not depend on timing, so like posters they are drawn at full resolution
+		// with every texture level resident (capture can also stop by itself, e.g. on a resize)
+		if (capture.active() != recordingPinned) {
+			if (capture.active())
+				streamer.loadFullResolution();
+			else
+				streamer.resumeStreaming();
+			recordingPinned = capture.active();
+		}
+		if (recordingPinned)
+			renderScale = maxRenderScale;
+
+		// Render the scene at the current resolution scale into the offscreen target, only
+		// inside the invalidated rectangle when nothing else changed
+		bool sceneDrawn = frameInvalidation.sceneDirty();
+		bool presented = sceneDrawn || frameInvalidation.presentRequested();
+		bool partial = false;
+		if (sceneDrawn) {
+			int scaledWidth = max(1, (int)(width * renderScale));
+			int scaledHeight = max(1, (int)(height * renderScale));
+			partial = frameInvalidation.partial() && scaledWidth == renderWidth && scaledHeight == renderHeight;
+			renderWidth = scaledWidth;
+			renderHeight = scaledHeight;
+			if (!partial)
+				frameTimer.begin();
+			glState.bindFramebuffer(GL_FRAMEBUFFER, sceneTarget.framebuffer);
+			glViewport(0, 0, renderWidth, renderHeight);
+			if (partial) {
+				int x0, y0, x1, y1;
+				frameInvalidation.rect(x0, y0, x1, y1);
+				float scaleX = (float)renderWidth / max(1, width), scaleY = (float)renderHeight / max(1, height);
+				x0 = max(0, (int)floor(x0 * scaleX) - partialRedrawMargin);
+				y0 = max(0, (int)floor(y0 * scaleY) - partialRedrawMargin);
+				x1 = min(renderWidth, (int)ceil(x1 * scaleX) + partialRedrawMargin);
+				y1 = min(renderHeight, (int)ceil(y1 * scaleY) + partialRedrawMargin);
+				glState.enable(GL_SCISSOR_TEST);
+				glScissor(x0, y0, max(0, x1 - x0), max(0, y1 - y0));
+			}
+
+			/* Render here */
+			glState.enable(GL_DEPTH_TEST);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+			// Draw the scene with the window's projection
+			projectionMatrix = glm::perspective(fov, (GLfloat)width / (GLfloat)height, projectionNear, projectionFar);		//(Field Of View, Width and height in floating point values, near plane, Far plane)
+			drawScene(projectionMatrix);
+			glState.disable(GL_SCISSOR_TEST);
+			frameDrawn = true;
+		}
+
+		// Upscale the scene into the window (also how the last frame is shown again)
+		if (presented) {
+			glState.bindFramebuffer(GL_FRAMEBUFFER, 0);
+			glViewport(0, 0, width, height);
+			glState.disable(GL_DEPTH_TEST);
+			glState.useProgram(upscaleShaderProgram);
+			glUniform2f(glGetUniformLocation(upscaleShaderProgram, "uvScale"), (GLfloat)renderWidth / sceneTarget.allocWidth, (GLfloat)renderHeight / sceneTarget.allocHeight);
+			glUniform2f(glGetUniformLocation(upscaleShaderProgram, "texelSize"), 1.0f / sceneTarget.allocWidth, 1.0f / sceneTarget.allocHeight);
+			glUniform1f(glGetUniformLocation(upscaleShaderProgram, "sharpness"), sharpenUpscale && renderScale < maxRenderScale ? 0.5f : 0.0f);
+			glState.bindTexture(GL_TEXTURE_2D, sceneTarget.color);
+			glState.bindVertexArray(screenVAO);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+			glState.bindVertexArray(0);
+			glState.useProgram(0);
+		}
+
+		// Pick next frame's resolution from the measured GPU time of full frames
+		if (sceneDrawn && !partial) {
+			frameTimer.end();
+			if (!recordingPinned)
+				updateRenderScale(frameTimer);
+		}
+		frameInvalidation.clear();
+
+		// Select the object under the cursor; only its outline before and after needs redrawing
+		if (pickRequested) {
+			double pickStart = glfwGetTime();
+			RayHit hit = sceneBvh.intersect(cursorRay(window, pickX, pickY));
+			double pickMicroseconds = (glfwGetTime() - pickStart) * 1000000.0;
+			if (hit.instance >= 0)
+				cout << "Picked " << sceneBvh.instanceName(hit.instance) << " (triangle " << hit.triangle << ") at distance " << hit.distance;
+			else
+				cout << "Picked nothing";
+			cout << " in " << pickMicroseconds << " us" << endl;
+			if (hit.instance != selectedInstance) {
+				invalidateInstance(selectedInstance);
+				invalidateInstance(hit.instance);
+				selectedInstance = hit.instance;
+			}
+			pickRequested = false;
+		}
+
+		// Render a poster of the current view
+		if (posterRequested) {
+			streamer.loadFullResolution();
+			showSelection = false;
+			renderPoster(drawScene, "poster.tif", (GLfloat)width / (GLfloat)height);
+			showSelection = true;
+			if (!recordingPinned)
+				streamer.resumeStreaming();
+			frameInvalidation.invalidateAll();
+			posterRequested = false;
+		}
+
+		// Record the finished frame
+		if (presented)
+			capture.captureFrame(width, height);
+
+		// Stream texture mips requested this frame
+		if (sceneDrawn && streamer.update())
+			frameInvalidation.invalidateAll();
+
+		if (memoryReportRequested) {
+			reportGpuMemory();
+			memoryReportRequested = false;
+		}
+
+		if (presented)
+			glState.endFrame();
+		if (stateReportRequested) {
+			glState.report();
+			stateReportRequested = false;
+		}
+
+		/* Swap front and back buffers */ 
+		if (presented)
+			glfwSwapBuffers(window);
+
+		/* Poll for and process events, sleeping until one arrives when there is nothing to draw */
+		bool cameraKeyHeld = keys[GLFW_KEY_W] || keys[GLFW_KEY_A] || keys[GLFW_KEY_S] || keys[GLFW_KEY_D] || keys[GLFW_KEY_Q] || keys[GLFW_KEY_E];
+		bool reducedResolution = renderWidth < max(1, (int)(width * maxRenderScale)) || renderHeight < max(1, (int)(height * maxRenderScale));
+		if (frameInvalidation.pending() || capture.active() || cameraKeyHeld)
+			glfwPollEvents();
+		else if (reducedResolution) {
+			// Going idle on a frame drawn at a reduced scale: draw one more at full resolution
+			// so a still picture is never left upscaled
+			renderScale = maxRenderScale;
+			frameInvalidation.invalidateAll();
+			glfwPollEvents();
+		}
+		else {
+			glfwWaitEventsTimeout(idleWaitSeconds);
+			lastFrame = (GLfloat)glfwGetTime(); // Time spent asleep is not frame time
+		}
 
 		//poll camera transformations
 		transformCamera();
@@ -704,13 +4019,17 @@ int main(void) {
 
 	}
 	//Clear GPU resources
-	glDeleteVertexArrays(1, &pastaVAO);
-	glDeleteBuffers(1, &pastaVBO);
-	glDeleteBuffers(1, &pastaEBO);
-	glDeleteVertexArrays(1, &floorVAO);
-	glDeleteBuffers(1, &floorVBO);
-	glDeleteBuffers(1, &floorEBO);
-
+	capture.shutdown();
+	streamer.shutdown();
+	lightmapBaker.shutdown();
+	sceneTarget.release();
+	frameTimer.release();
+	screenVAO.release();
+	for (GLHandle* object : sceneObjects)
+		object->release();
+	sceneShaders.release();
+	upscaleShaderProgram.release();
+	textureStreamer = nullptr;
 
 	glfwTerminate();
 	return 0;
@@ -721,6 +4040,49 @@ int main(void) {
 //Define Input callback functions
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
 
+	if (key == GLFW_KEY_UNKNOWN)
+		return;
+
+	// Most keys change what is drawn; camera keys are also caught by the loop's camera check
+	if (action == GLFW_PRESS)
+		frameInvalidation.invalidateAll();
+
+	if (key == GLFW_KEY_F1 && action == GLFW_PRESS)
+		memoryReportRequested = true;
+
+	if (key == GLFW_KEY_F2 && action == GLFW_PRESS) {
+		dynamicResolution = !dynamicResolution;
+		cout << "Dynamic resolution " << (dynamicResolution ? "on" : "off") << endl;
+	}
+
+	if (key == GLFW_KEY_F3 && action == GLFW_PRESS) {
+		sharpenUpscale = !sharpenUpscale;
+		cout << "Upscale filter: " << (sharpenUpscale ? "sharpen" : "bilinear") << endl;
+	}
+
+	if (key == GLFW_KEY_F5 && action == GLFW_PRESS)
+		captureToggleRequested = true;
+
+	if (key == GLFW_KEY_F6 && action == GLFW_PRESS) {
+		const char* formatNames[] = { "PNG", "QOI", "Y4M" };
+		captureFormat = (CaptureFormat)(((int)captureFormat + 1) % 3);
+		cout << "Capture format: " << formatNames[(int)captureFormat] << " (applies to the next recording)" << endl;
+	}
+
+	if (key == GLFW_KEY_F7 && action == GLFW_PRESS)
+		posterRequested = true;
+
+	if (key == GLFW_KEY_F8 && action == GLFW_PRESS)
+		bakeRequested = true;
+
+	if (key == GLFW_KEY_F9 && action == GLFW_PRESS) {
+		useBakedLighting = !useBakedLighting;
+		cout << "Baked lighting " << (useBakedLighting ? "on" : "off") << endl;
+	}
+
+	if (key == GLFW_KEY_F10 && action == GLFW_PRESS)
+		stateReportRequested = true;
+
 
 	if (action == GLFW_PRESS)
 		keys[key] = true;
@@ -790,12 +4152,23 @@ void cursor_position_callback(GLFWwindow* window, double xpos, double ypos) {
 	}
 
 }
+void window_refresh_callback(GLFWwindow* window) {
+
+	// The window contents were damaged; show the last frame again
+	frameInvalidation.requestPresent();
+}
 void mouse_button_callback(GLFWwindow* window, int button, int action, int mods) {
 
 	if (action == GLFW_PRESS)
 		mouseButtons[button] = true;
 	else if (action == GLFW_RELEASE)
 		mouseButtons[button] = false;
+
+	// Alt + left button orbits, a plain left click picks
+	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && !keys[GLFW_KEY_LEFT_ALT]) {
+		glfwGetCursorPos(window, &pickX, &pickY); // The cursor may have moved on by the time the pick runs
+		pickRequested = true;
+	}
 }
 
 //define getTarget function
@@ -838,6 +4211,18 @@ void initCamera() {
 }
 
 
+void reportGpuMemory() {
+	cout << "GPU memory: " << gpuMemory.textures << " textures (" << gpuMemory.textureBytes / 1024 << " KB), "
+		<< gpuMemory.buffers << " buffers (" << gpuMemory.bufferBytes / 1024 << " KB), "
+		<< gpuMemory.vertexArrays << " vertex arrays, " << gpuMemory.framebuffers << " framebuffers, "
+		<< gpuMemory.renderbuffers << " renderbuffers, " << gpuMemory.queries << " queries, "
+		<< gpuMemory.programs << " programs, " << gpuMemory.fences << " fences" << endl;
+	cout << "  Render scale: " << (int)(renderScale * 100.0f) << "% (" << renderWidth << "x" << renderHeight << ")" << endl;
+	if (textureStreamer)
+		textureStreamer->report();
+}
+
+
 void UProcessInput(GLFWwindow* window) {
 	static const float cameraSpeed = 3.5f;
 